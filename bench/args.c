@@ -0,0 +1,42 @@
+/* Time (+ 1 1 ... 1) as the number of arguments doubles. Reading and
+   evaluating should both take the same time per argument at every size.
+
+     cc -std=c11 -O2 -I. bench/args.c mpc.c -lm -o args-bench
+     ./args-bench
+*/
+#include "bench.h"
+
+int main(void) {
+
+  bench_init();
+  printf("%10s %10s %10s %12s %12s\n", "args", "read ms", "eval ms",
+    "read ns/arg", "eval ns/arg");
+  for (int n = 25000; n <= 1600000; n *= 2) {
+    char *s = malloc(2 * n + 4);
+    strcpy(s, "(+");
+    for (int i = 0; i < n; i++) {
+      strcpy(s + 2 + 2 * i, " 1");
+    }
+    strcat(s, ")");
+
+    bench_timer read = BENCH_TIMER;
+    bench_timer eval = BENCH_TIMER;
+    for (int r = 0; r < 3; r++) {
+      bench_start(&read);
+      lval *v = lval_scan(s, strlen(s));
+      bench_stop(&read);
+      bench_start(&eval);
+      lval *x = lval_run(v);
+      bench_stop(&eval);
+      if (x->type != LVAL_NUM || x->num != n) {
+        printf("wrong result\n");
+        return 1;
+      }
+      lval_del(x);
+    }
+    printf("%10i %10.2f %10.2f %12.1f %12.1f\n", n, read.best * 1e3,
+      eval.best * 1e3, read.best * 1e9 / n, eval.best * 1e9 / n);
+    free(s);
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+/* Shared setup of the benchmarks, which build the whole interpreter in
+   with their workload and time parts of it, keeping the shortest of
+   several runs.
+
+     cc -std=c11 -O2 -I. bench/<name>.c mpc.c -lm -o <name>-bench
+*/
+#ifndef bench_h
+#define bench_h
+
+#define _POSIX_C_SOURCE 199309L
+#define LISPTY_RUNTIME
+#include "parsing.c"
+
+/* Shortest time in seconds of the runs of one part of a benchmark */
+typedef struct {
+  double best;
+  double start;
+} bench_timer;
+
+#define BENCH_TIMER { 1e9, 0 }
+
+double bench_now(void) {
+
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void bench_start(bench_timer *b) {
+
+  b->start = bench_now();
+}
+
+/* End a run, keeping its time if it is the shortest so far */
+void bench_stop(bench_timer *b) {
+
+  double t = bench_now() - b->start;
+  b->best = t < b->best ? t : b->best;
+}
+
+/* Set up the builtins and seed generated input the same on every run */
+void bench_init(void) {
+
+  lval_builtins_init();
+  srand(1);
+}
+
+#endif
@@ -0,0 +1,119 @@
+/* Compare the per-operator kernels of builtin_op with the generic loop
+   they replaced, which tested the operator for every operand, folding 1M
+   operands. Also times whole calls of each operator on 1M operands.
+
+     cc -std=c11 -O2 -I. bench/ops.c mpc.c -lm -o ops-bench
+     ./ops-bench
+*/
+#include "bench.h"
+
+#define BENCH_OPERANDS 1000000
+
+/* The loop of builtin_op before the kernels, over an array */
+long bench_generic(int op, long x, long *y, int n) {
+
+  for (int i = 0; i < n; i++) {
+    if (op == LFUN_ADD) {
+      x += y[i];
+    }
+    if (op == LFUN_SUB) {
+      x -= y[i];
+    }
+    if (op == LFUN_MUL) {
+      x *= y[i];
+    }
+    if (op == LFUN_DIV) {
+      if (y[i] == 0) {
+        return 0;
+      }
+      x /= y[i];
+    }
+    if (op == LFUN_MOD) {
+      if (y[i] == 0) {
+        return 0;
+      }
+      x %= y[i];
+    }
+    if (op == LFUN_MIN) {
+      if (x > y[i]) {
+        x = y[i];
+      }
+    }
+    if (op == LFUN_MAX) {
+      if (x < y[i]) {
+        x = y[i];
+      }
+    }
+  }
+  return x;
+}
+
+/* Operands of op that neither overflow nor reach zero */
+long bench_operand(int op) {
+
+  switch (op) {
+    case LFUN_MUL:
+    case LFUN_DIV:
+      return rand() % 2 ? 1 : -1;
+    case LFUN_MIN:
+    case LFUN_MAX:
+      return (long)rand() * rand() - (long)rand() * rand();
+    default:
+      return rand() % 1000 + 1;
+  }
+}
+
+int main(void) {
+
+  int ops[] = { LFUN_ADD, LFUN_SUB, LFUN_MUL, LFUN_DIV, LFUN_MOD, LFUN_MIN,
+    LFUN_MAX };
+  long *y = malloc(sizeof(long) * BENCH_OPERANDS);
+  char *s = malloc(24 * BENCH_OPERANDS);
+  bench_init();
+
+  printf("%-4s %12s %12s %12s\n", "op", "generic ms", "kernel ms",
+    "builtin ms");
+  for (int k = 0; k < (int)(sizeof(ops) / sizeof(ops[0])); k++) {
+    int op = ops[k];
+    long start = op == LFUN_MOD ? LONG_MAX : 1000000007;
+    for (int i = 0; i < BENCH_OPERANDS; i++) {
+      y[i] = bench_operand(op);
+    }
+
+    bench_timer generic = BENCH_TIMER;
+    bench_timer kernel = BENCH_TIMER;
+    for (int r = 0; r < 5; r++) {
+      bench_start(&generic);
+      volatile long g = bench_generic(op, start, y, BENCH_OPERANDS);
+      bench_stop(&generic);
+      long x = start;
+      bench_start(&kernel);
+      lval_op_kernel(op, &x, y, BENCH_OPERANDS);
+      bench_stop(&kernel);
+      if (x != g) {
+        printf("%s: results differ\n", lval_fun_names[op]);
+        return 1;
+      }
+    }
+
+    /* the same operands through a whole call */
+    int len = sprintf(s, "(%s %li", lval_fun_names[op], start);
+    for (int i = 0; i < BENCH_OPERANDS; i++) {
+      len += sprintf(s + len, " %li", y[i]);
+    }
+    strcpy(s + len, ")");
+    bench_timer call = BENCH_TIMER;
+    for (int r = 0; r < 3; r++) {
+      lval *v = lval_scan(s, len + 1);
+      bench_start(&call);
+      lval_del(lval_run(v));
+      bench_stop(&call);
+    }
+
+    printf("%-4s %12.2f %12.2f %12.2f\n", lval_fun_names[op],
+      generic.best * 1e3, kernel.best * 1e3, call.best * 1e3);
+  }
+  free(s);
+  free(y);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/* Time formatting 1M doubles with lval_dbl_format against a single %.17g,
+   which reads back but is not shortest, and against the retry loop it
+   replaced, which tried %.15g, %.16g and %.17g until strtod gave the
+   double back. Every formatted double is checked to read back.
+
+     cc -std=c11 -O2 -I. bench/print.c mpc.c -lm -o print-bench
+     ./print-bench
+*/
+#include "bench.h"
+
+#define BENCH_DOUBLES 1000000
+
+/* The formatting of lval_dbl_format before it found the shortest digits */
+void bench_retry(double x, char *s) {
+
+  int p = 15;
+  snprintf(s, LVAL_DBL_DIGITS, "%.*g", p, x);
+  while (p < 17 && strtod(s, NULL) != x) {
+    snprintf(s, LVAL_DBL_DIGITS, "%.*g", ++p, x);
+  }
+  if (strspn(s, "-0123456789") == strlen(s)) {
+    strcat(s, ".0");
+  }
+}
+
+void bench_printf(double x, char *s) {
+
+  snprintf(s, LVAL_DBL_DIGITS, "%.17g", x);
+}
+
+/* Best of 5 runs of format over xs, in ns per double, or -1 when one
+   does not read back */
+double bench_format(void (*format)(double, char *), double *xs) {
+
+  char s[LVAL_DBL_DIGITS];
+  bench_timer t = BENCH_TIMER;
+  for (int r = 0; r < 5; r++) {
+    bench_start(&t);
+    for (int i = 0; i < BENCH_DOUBLES; i++) {
+      format(xs[i], s);
+    }
+    bench_stop(&t);
+  }
+  for (int i = 0; i < BENCH_DOUBLES; i++) {
+    format(xs[i], s);
+    if (strtod(s, NULL) != xs[i]) {
+      return -1;
+    }
+  }
+  return t.best * 1e9 / BENCH_DOUBLES;
+}
+
+int main(void) {
+
+  double *xs = malloc(sizeof(double) * BENCH_DOUBLES);
+  bench_init();
+
+  printf("%-12s %12s %12s %12s\n", "doubles", "retry ns", "%.17g ns",
+    "shortest ns");
+  for (int k = 0; k < 3; k++) {
+    const char *name = NULL;
+    for (int i = 0; i < BENCH_DOUBLES; i++) {
+      uint64_t bits = (uint64_t)rand() << 42 ^ (uint64_t)rand() << 21 ^ rand();
+      if (k == 0) {
+        /* any finite bit pattern, mostly 17 digits */
+        name = "random bits";
+        memcpy(&xs[i], &bits, sizeof(double));
+        if (!isfinite(xs[i])) {
+          xs[i] = 0;
+        }
+      } else if (k == 1) {
+        name = "short";
+        xs[i] = (rand() % 1000000) / 1000.0;
+      } else {
+        name = "integral";
+        xs[i] = rand() % 100000;
+      }
+    }
+    double retry = bench_format(bench_retry, xs);
+    double single = bench_format(bench_printf, xs);
+    double shortest = bench_format(lval_dbl_format, xs);
+    if (retry < 0 || single < 0 || shortest < 0) {
+      printf("%s: formatted double does not read back\n", name);
+      return 1;
+    }
+    printf("%-12s %12.1f %12.1f %12.1f\n", name, retry, single, shortest);
+  }
+  free(xs);
+  return 0;
+}
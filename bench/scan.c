@@ -0,0 +1,112 @@
+/* Throughput of the tokenizer kernels, of lval_scan using each of them,
+   and of the mpc reader, reading file or else about 11 MB of generated
+   expressions. mpc only reads the first 256 KB, being much slower.
+
+     cc -std=c11 -O2 -I. bench/scan.c mpc.c -lm -o scan-bench
+     ./scan-bench [file.lspy]
+*/
+#include "bench.h"
+
+#define BENCH_MPC_BYTES 262144
+
+typedef size_t (*bench_tokenizer)(const char *s, size_t n, uint64_t *atom,
+  uint32_t *out);
+
+/* Lines of arithmetic on numbers, decimals and vectors */
+char *bench_input(void) {
+
+  int lines = 200000;
+  char *s = malloc(lines * 64);
+  size_t n = 0;
+  for (int i = 0; i < lines; i++) {
+    n += sprintf(s + n, "(+ %i {%i %i.5 -%i} (max %i %i))\n", rand() % 1000000,
+      rand() % 1000000, rand() % 1000000, rand() % 1000000, rand() % 1000000,
+      rand() % 1000000);
+  }
+  return s;
+}
+
+/* Time indexing all of s, and reading it with lval_scan, using tokenizer */
+void bench_tokens(const char *name, bench_tokenizer tokens, char *s,
+  size_t n) {
+
+  uint32_t *index = malloc(sizeof(uint32_t) * LVAL_SCAN_WINDOW);
+  size_t count = 0;
+  bench_timer index_time = BENCH_TIMER;
+  for (int r = 0; r < 5; r++) {
+    uint64_t atom = 0;
+    count = 0;
+    bench_start(&index_time);
+    for (size_t w = 0; w < n; w += LVAL_SCAN_WINDOW) {
+      count += tokens(s + w, n - w < LVAL_SCAN_WINDOW ? n - w
+        : LVAL_SCAN_WINDOW, &atom, index);
+    }
+    bench_stop(&index_time);
+  }
+  free(index);
+
+  lval_scan_tokens = tokens;
+  bench_timer read = BENCH_TIMER;
+  for (int r = 0; r < 3; r++) {
+    bench_start(&read);
+    lval *x = lval_scan(s, n);
+    bench_stop(&read);
+    lval_del(x);
+    /* every read starts from fresh slabs, like a new process */
+    lval_pool_release();
+  }
+  printf("%-8s index %8.0f MB/s   lval_scan %6.1f MB/s   (%zu tokens)\n",
+    name, n / 1e6 / index_time.best, n / 1e6 / read.best, count);
+}
+
+int main(int argc, char **argv) {
+
+  bench_init();
+  lval_reader_init();
+  char *s = argc > 1 ? lval_slurp(argv[1]) : bench_input();
+  if (!s) {
+    printf("%s: cannot read\n", argv[1]);
+    return 1;
+  }
+  size_t n = strlen(s);
+  lval *x = lval_scan(s, n);
+  if (!x) {
+    printf("input does not parse\n");
+    return 1;
+  }
+  lval_del(x);
+  printf("%.2f MB\n", n / 1e6);
+
+  bench_tokens("scalar", lval_scan_index, s, n);
+#ifdef LVAL_AVX2
+  bench_tokens("sse2", lval_scan_index_sse2, s, n);
+  if (__builtin_cpu_supports("avx2")) {
+    bench_tokens("avx2", lval_scan_index_avx2, s, n);
+  }
+#endif
+
+  /* a prefix of whole lines for mpc */
+  size_t m = n;
+  if (m > BENCH_MPC_BYTES) {
+    m = BENCH_MPC_BYTES;
+    while (m && s[m - 1] != '\n') {
+      m--;
+    }
+  }
+  char c = s[m];
+  s[m] = '\0';
+  mpc_result_t r;
+  double t = bench_now();
+  if (mpc_parse("bench", s, lval_reader.lispty, &r)) {
+    t = bench_now() - t;
+    lval_del(r.output);
+    printf("%-8s %.0f KB at %.3f MB/s\n", "mpc", m / 1e3, m / 1e6 / t);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  s[m] = c;
+  lval_reader_release();
+  free(s);
+  return 0;
+}
@@ -0,0 +1,133 @@
+/* Compare the tree walker with compiling to bytecode and running the VM,
+   on expressions read beforehand that folding cannot reduce, because
+   every call has an eval below it, and on arithmetic that folds to a
+   constant. Compiling and running are timed apart, and every result is
+   checked against the tree walker.
+
+     cc -std=c11 -O2 -I. bench/vm.c mpc.c -lm -o vm-bench
+     ./vm-bench
+*/
+#include "bench.h"
+
+#define BENCH_LINES 100000
+
+/* Write a tree of calls with depth levels and (eval {k}) leaves to s,
+   giving the length written */
+int bench_tree(char *s, int depth) {
+
+  if (depth == 0) {
+    return sprintf(s, "(eval {%i})", rand() % 10);
+  }
+  const char *ops[] = { "+", "-", "min", "max" };
+  int n = sprintf(s, "(%s ", ops[rand() % 4]);
+  n += bench_tree(s + n, depth - 1);
+  s[n++] = ' ';
+  n += bench_tree(s + n, depth - 1);
+  s[n++] = ')';
+  s[n] = '\0';
+  return n;
+}
+
+/* Lines of workload k, named in name */
+char *bench_input(int k, const char **name) {
+
+  char *s = malloc(BENCH_LINES * 128);
+  size_t n = 0;
+  for (int i = 0; i < BENCH_LINES; i++) {
+    if (k == 0) {
+      *name = "eval call";
+      n += sprintf(s + n, "(+ %i (eval {* %i (- %i %i)}) (max %i %i))\n",
+        rand() % 1000, rand() % 1000, rand() % 1000, rand() % 1000,
+        rand() % 1000, rand() % 1000);
+    } else if (k == 1) {
+      /* a line in eight holds a tree of 32 evals */
+      *name = "eval tree";
+      if (i % 8 == 0) {
+        n += bench_tree(s + n, 5);
+        s[n++] = '\n';
+      }
+    } else if (k == 2) {
+      *name = "eval chain";
+      for (int j = 0; j < 8; j++) {
+        n += sprintf(s + n, "(eval {+ %i ", rand() % 10);
+      }
+      n += sprintf(s + n, "0");
+      for (int j = 0; j < 8; j++) {
+        n += sprintf(s + n, "})");
+      }
+      s[n++] = '\n';
+    } else {
+      *name = "arithmetic";
+      n += sprintf(s + n, "(+ %i (* %i (- %i %i)) (max %i %i))\n",
+        rand() % 1000, rand() % 1000, rand() % 1000, rand() % 1000,
+        rand() % 1000, rand() % 1000);
+    }
+  }
+  s[n] = '\0';
+  return s;
+}
+
+/* Whether results x and y are the same number */
+int bench_same(lval *x, lval *y) {
+
+  return x->type == LVAL_NUM && y->type == LVAL_NUM && x->num == y->num;
+}
+
+int main(void) {
+
+  bench_init();
+  printf("%-12s %10s %10s %10s %10s %8s\n", "workload", "tree ms",
+    "compile ms", "run ms", "vm ms", "speedup");
+  for (int k = 0; k < 4; k++) {
+    const char *name = NULL;
+    char *s = bench_input(k, &name);
+    lval *v = lval_scan(s, strlen(s));
+    int n = v->count;
+    lval **want = malloc(sizeof(lval *) * n);
+    lprog *progs = calloc(n, sizeof(lprog));
+
+    bench_timer tree = BENCH_TIMER;
+    bench_timer compile = BENCH_TIMER;
+    bench_timer run = BENCH_TIMER;
+    for (int r = 0; r < 5; r++) {
+      bench_start(&tree);
+      for (int i = 0; i < n; i++) {
+        want[i] = lval_eval(lval_copy(v->cell[i]));
+      }
+      bench_stop(&tree);
+
+      bench_start(&compile);
+      for (int i = 0; i < n; i++) {
+        memset(&progs[i], 0, sizeof(lprog));
+        lprog_compile(&progs[i], lval_copy(v->cell[i]));
+        lprog_emit(&progs[i], LOP_RET);
+      }
+      bench_stop(&compile);
+
+      bench_start(&run);
+      for (int i = 0; i < n; i++) {
+        lval *x = lprog_run(&progs[i]);
+        if (!bench_same(x, want[i])) {
+          printf("%s: line %i differs\n", name, i + 1);
+          return 1;
+        }
+        lval_del(x);
+      }
+      bench_stop(&run);
+
+      for (int i = 0; i < n; i++) {
+        lprog_release(&progs[i]);
+        lval_del(want[i]);
+      }
+    }
+    double vm = compile.best + run.best;
+    printf("%-12s %10.2f %10.2f %10.2f %10.2f %7.2fx\n", name,
+      tree.best * 1e3, compile.best * 1e3, run.best * 1e3, vm * 1e3,
+      tree.best / vm);
+    free(progs);
+    free(want);
+    lval_del(v);
+    free(s);
+  }
+  return 0;
+}
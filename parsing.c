@@ -1,54 +1,889 @@
 #include "mpc.h"
+/* LISPTY_RUNTIME builds this file without the prompt, as the runtime of
+   programs translated to C by --emit-c */
+#ifndef LISPTY_RUNTIME
 #include <editline/readline.h>
+#endif
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
+/* AVX2 kernels are compiled in on x86-64 and picked at runtime */
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define LVAL_AVX2
+#endif
 
-/* Value that represent number, symbol, expr, Sexpr */
+enum { LVAL_NUM, LVAL_BIG, LVAL_DBL, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR,
+  LVAL_QEXPR, LVAL_VEC, LVAL_MAT, LVAL_TYPES };
+
+/* Opcodes of the builtins, indexing lval_builtins */
+enum {
+  LFUN_ADD, LFUN_SUB, LFUN_MUL, LFUN_DIV, LFUN_MOD, LFUN_POW, LFUN_MIN,
+  LFUN_MAX, LFUN_LIST, LFUN_HEAD, LFUN_TAIL, LFUN_JOIN, LFUN_EVAL,
+  LFUN_POWMOD, LFUN_SUM, LFUN_MATRIX, LFUN_ROWS, LFUN_SHAPE, LFUN_TRANSPOSE,
+  LFUN_MATMUL, LFUN_ALLOC_STATS, LFUN_GC_STATS, LFUN_COUNT
+};
+
+/* Names of the builtins by opcode, interned at startup */
+char *lval_fun_names[LFUN_COUNT] = {
+  "+", "-", "*", "/", "%", "^", "min", "max", "list", "head", "tail", "join",
+  "eval", "powmod", "sum", "matrix", "rows", "shape", "transpose", "matmul",
+  "alloc-stats", "gc-stats"
+};
+
+struct lval;
+struct lbig;
+struct lmat;
+
+/* Builtin taking its evaluated arguments and its own opcode */
+typedef struct lval *(*lbuiltin)(struct lval *, int);
+
+/* Value that represent number, symbol, expr, Sexpr.
+   Only the payload selected by type is live, count is used by expressions
+   and vectors. Vectors keep their numbers unboxed in a cell array.
+   refs counts the owners of the value, which must not be changed in place
+   while it is shared. origin is the type the node was allocated as, which
+   the allocation counters go by while type changes in place. Functions
+   keep their opcode next to the builtin */
 typedef struct lval {
-  int type;
-  long num;
-  char *err;
-  char *sym;
-  int count;
-  struct lval **cell;
+  unsigned char type;
+  unsigned char flags;
+  unsigned short refs : 12;
+  unsigned short origin : 4;
+  union {
+    int count;
+    int op;
+  };
+  union {
+    long num;
+    struct lbig *big;
+    struct lmat *mat;
+    double dbl;
+    char *err;
+    char *sym;
+    lbuiltin fun;
+    struct lval **cell;
+    long *nums;
+    double *dbls;
+    struct lval *next;
+  };
 } lval;
 
+_Static_assert(sizeof(lval) <= 16, "lval must stay within 16 bytes");
+_Static_assert(LVAL_TYPES <= 16, "types must fit the origin of nodes");
+_Static_assert(sizeof(long) == sizeof(lval *) && sizeof(double) == sizeof(lval *),
+  "vector elements must fit cell slots");
+
+/* Owners a value can have before copies stop being shared */
+#define LVAL_REFS_MAX 0xfff
+
+/* Flags of lval nodes */
+enum {
+  LVAL_FREED = 1,     /* node is on a free list of the pool */
+  LVAL_MARKED = 2,    /* node was reached by the collector */
+  LVAL_FORWARDED = 4, /* nursery node was promoted to next */
+  LVAL_DOUBLES = 8,   /* vector holds dbls instead of nums */
+  LVAL_TAIL = 16      /* Sexpr left by eval for its caller to evaluate */
+};
+
+/* Number of lval nodes carved out of a single slab */
+#define LVAL_SLAB_NODES 1024
+
+/* Block of lval nodes allocated with a single malloc */
+typedef struct lval_slab {
+  struct lval_slab *next;
+  lval nodes[LVAL_SLAB_NODES];
+} lval_slab;
+
+/* Slab allocator state with per-type free lists, and counters of nodes
+   allocated and freed by the type they were allocated as */
+struct {
+  lval_slab *slabs;
+  int used;
+  lval *free[LVAL_TYPES];
+  long slab_count;
+  long allocs[LVAL_TYPES];
+  long frees[LVAL_TYPES];
+} lval_pool;
+
+/* Frame of the work stacks walking nested expressions without recursion:
+   an expression and the index of its next child */
+typedef struct {
+  lval *v;
+  int i;
+} lval_frame;
+
+/* Frames a work stack holds before moving to the heap */
+#define LVAL_STACK_MIN 32
+
+/* Work stack of frames, kept in place while it is shallow and grown on
+   the heap, so nesting is only limited by memory */
+typedef struct lval_stack {
+  lval_frame *frames;
+  int count;
+  int cap;
+  lval_frame local[LVAL_STACK_MIN];
+} lval_stack;
+
+/* Start an empty work stack */
+void lval_stack_init(lval_stack *s) {
+
+  s->frames = s->local;
+  s->count = 0;
+  s->cap = LVAL_STACK_MIN;
+}
+
+/* Push frame visiting the children of v from index i */
+void lval_stack_push(lval_stack *s, lval *v, int i) {
+
+  if (s->count == s->cap) {
+    s->cap *= 2;
+    if (s->frames == s->local) {
+      s->frames = malloc(sizeof(lval_frame) * s->cap);
+      memcpy(s->frames, s->local, sizeof(s->local));
+    } else {
+      s->frames = realloc(s->frames, sizeof(lval_frame) * s->cap);
+    }
+  }
+  s->frames[s->count].v = v;
+  s->frames[s->count].i = i;
+  s->count++;
+}
+
+/* Free the frames of a work stack that outgrew its place */
+void lval_stack_release(lval_stack *s) {
+
+  if (s->frames != s->local) {
+    free(s->frames);
+  }
+}
+
+/* Number of lval nodes in the nursery of the collector */
+#define LVAL_NURSERY_NODES 65536
+
+/* Tracing collector state, used instead of lval_del once enabled */
+struct {
+  int enabled;
+  int pending;
+  lval *nursery;
+  int used;
+  lval ***roots;
+  int root_count;
+  int root_cap;
+  lval_stack **stacks;
+  int stack_count;
+  int stack_cap;
+  long collections;
+  long promoted;
+  long swept;
+  double pause_total;
+  double pause_max;
+} lval_gc;
+
+/* Get a node from the free list of its type, or carve a new one. The node
+   is left for lval_alloc to set up, or for a promoted node to be copied in */
+lval *lval_slab_alloc(int type) {
+
+  lval *v = lval_pool.free[type];
+  if (v) {
+    lval_pool.free[type] = v->next;
+  } else {
+    /* reuse a node released by another type before growing */
+    for (int t = 0; t < LVAL_TYPES && !v; t++) {
+      if (lval_pool.free[t]) {
+        v = lval_pool.free[t];
+        lval_pool.free[t] = v->next;
+      }
+    }
+  }
+  if (!v) {
+    if (!lval_pool.slabs || lval_pool.used == LVAL_SLAB_NODES) {
+      lval_slab *s = malloc(sizeof(lval_slab));
+      s->next = lval_pool.slabs;
+      lval_pool.slabs = s;
+      lval_pool.used = 0;
+      lval_pool.slab_count++;
+    }
+    v = &lval_pool.slabs->nodes[lval_pool.used++];
+  }
+  return v;
+}
+
+/* Get a node from the nursery when collecting, else from the pool */
+lval *lval_alloc(int type) {
+
+  lval *v = NULL;
+  if (lval_gc.enabled) {
+    if (lval_gc.used < LVAL_NURSERY_NODES) {
+      v = &lval_gc.nursery[lval_gc.used++];
+    } else {
+      /* collect at the next evaluation, allocate in the pool until then */
+      lval_gc.pending = 1;
+    }
+  }
+  if (!v) {
+    v = lval_slab_alloc(type);
+  }
+  lval_pool.allocs[type]++;
+  v->type = type;
+  v->origin = type;
+  v->flags = 0;
+  v->refs = 1;
+  return v;
+}
+
+/* Return a node to the free list of its type */
+void lval_free(lval *v) {
+
+  lval_pool.frees[v->origin]++;
+  v->flags = LVAL_FREED;
+  v->next = lval_pool.free[v->type];
+  lval_pool.free[v->type] = v;
+}
+
+/* Release every slab at once */
+void lval_pool_release(void) {
+
+  while (lval_pool.slabs) {
+    lval_slab *s = lval_pool.slabs;
+    lval_pool.slabs = s->next;
+    free(s);
+  }
+  memset(&lval_pool, 0, sizeof(lval_pool));
+  free(lval_gc.nursery);
+  free(lval_gc.roots);
+  free(lval_gc.stacks);
+  memset(&lval_gc, 0, sizeof(lval_gc));
+}
+
+/* Arbitrary precision integer. The magnitude is kept in little endian
+   base 2^32 limbs without leading zero limbs, so zero has no limbs */
+typedef struct lbig {
+  int neg;
+  int len;
+  uint32_t d[];
+} lbig;
+
+/* Limbs from which multiplication switches to Karatsuba */
+#define LBIG_KARATSUBA 32
+
+/* Largest number of bits a power is allowed to produce */
+#define LBIG_MAX_BITS (1L << 24)
+
+/* Allocate a zero filled bignum with len limbs */
+lbig *lbig_new(int len) {
+
+  lbig *b = calloc(1, sizeof(lbig) + sizeof(uint32_t) * len);
+  b->len = len;
+  return b;
+}
+
+/* Drop leading zero limbs */
+lbig *lbig_trim(lbig *b) {
+
+  while (b->len && !b->d[b->len - 1]) {
+    b->len--;
+  }
+  if (!b->len) {
+    b->neg = 0;
+  }
+  return b;
+}
+
+lbig *lbig_copy(lbig *b) {
+
+  lbig *x = lbig_new(b->len);
+  x->neg = b->neg;
+  memcpy(x->d, b->d, sizeof(uint32_t) * b->len);
+  return x;
+}
+
+lbig *lbig_from_long(long x) {
+
+  uint64_t m = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  lbig *b = lbig_new(2);
+  b->neg = x < 0;
+  b->d[0] = (uint32_t)m;
+  b->d[1] = (uint32_t)(m >> 32);
+  return lbig_trim(b);
+}
+
+/* Store bignum in x if it fits in a long */
+int lbig_to_long(lbig *b, long *x) {
+
+  if (b->len > 2) {
+    return 0;
+  }
+  uint64_t m = 0;
+  for (int i = b->len - 1; i >= 0; i--) {
+    m = (m << 32) | b->d[i];
+  }
+  if (m > (uint64_t)LONG_MAX + b->neg) {
+    return 0;
+  }
+  *x = b->neg ? (long)(0 - m) : (long)m;
+  return 1;
+}
+
+/* Get nearest double of bignum. Its leading 64 bits are rounded once to
+   53, half to even, with the digits below them only telling whether the
+   rest is zero */
+double lbig_to_double(lbig *b) {
+
+  if (!b->len) {
+    return 0;
+  }
+  int n = b->len - 1;
+  int s = __builtin_clz(b->d[n]);
+  uint64_t m = (uint64_t)b->d[n] << 32 | (n >= 1 ? b->d[n - 1] : 0);
+  uint32_t low = n >= 2 ? b->d[n - 2] : 0;
+  if (s) {
+    m = m << s | low >> (32 - s);
+    low <<= s;
+  }
+  int sticky = low != 0;
+  for (int i = n - 3; i >= 0 && !sticky; i--) {
+    sticky = b->d[i] != 0;
+  }
+  uint64_t r = m >> 11;
+  uint64_t rest = m & 0x7ff;
+  if (rest > 0x400 || (rest == 0x400 && (sticky || (r & 1)))) {
+    r++;
+  }
+  /* m holds the bits from 32 * (n + 1) - s down */
+  double x = ldexp((double)r, 32 * (n + 1) - s - 53);
+  return b->neg ? -x : x;
+}
+
+/* Compare magnitudes */
+int lbig_cmp_mag(lbig *a, lbig *b) {
+
+  if (a->len != b->len) {
+    return a->len < b->len ? -1 : 1;
+  }
+  for (int i = a->len - 1; i >= 0; i--) {
+    if (a->d[i] != b->d[i]) {
+      return a->d[i] < b->d[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+int lbig_cmp(lbig *a, lbig *b) {
+
+  if (a->neg != b->neg) {
+    return a->neg ? -1 : 1;
+  }
+  return a->neg ? lbig_cmp_mag(b, a) : lbig_cmp_mag(a, b);
+}
+
+/* Add magnitude of b into r starting at limb off, r must be long enough */
+void lbig_add_into(lbig *r, lbig *b, int off) {
+
+  uint64_t carry = 0;
+  int i = 0;
+  for (; i < b->len; i++) {
+    carry += (uint64_t)r->d[off + i] + b->d[i];
+    r->d[off + i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  for (; carry; i++) {
+    carry += r->d[off + i];
+    r->d[off + i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+}
+
+/* Get |a| + |b| */
+lbig *lbig_add_mag(lbig *a, lbig *b) {
+
+  lbig *r = lbig_new((a->len > b->len ? a->len : b->len) + 1);
+  memcpy(r->d, a->d, sizeof(uint32_t) * a->len);
+  lbig_add_into(r, b, 0);
+  return lbig_trim(r);
+}
+
+/* Get |a| - |b| for |a| >= |b| */
+lbig *lbig_sub_mag(lbig *a, lbig *b) {
+
+  lbig *r = lbig_new(a->len);
+  int64_t borrow = 0;
+  for (int i = 0; i < a->len; i++) {
+    int64_t t = (int64_t)a->d[i] - (i < b->len ? b->d[i] : 0) - borrow;
+    borrow = t < 0;
+    r->d[i] = (uint32_t)(t + (borrow << 32));
+  }
+  return lbig_trim(r);
+}
+
+lbig *lbig_add(lbig *a, lbig *b) {
+
+  lbig *r;
+  if (a->neg == b->neg) {
+    r = lbig_add_mag(a, b);
+    r->neg = a->neg;
+  } else if (lbig_cmp_mag(a, b) >= 0) {
+    r = lbig_sub_mag(a, b);
+    r->neg = a->neg;
+  } else {
+    r = lbig_sub_mag(b, a);
+    r->neg = b->neg;
+  }
+  return lbig_trim(r);
+}
+
+lbig *lbig_sub(lbig *a, lbig *b) {
+
+  b->neg = !b->neg;
+  lbig *r = lbig_add(a, b);
+  b->neg = !b->neg;
+  return r;
+}
+
+/* Get limbs lo to hi of magnitude of b */
+lbig *lbig_slice(lbig *b, int lo, int hi) {
+
+  hi = hi < b->len ? hi : b->len;
+  lbig *r = lbig_new(hi > lo ? hi - lo : 0);
+  memcpy(r->d, b->d + lo, sizeof(uint32_t) * r->len);
+  return lbig_trim(r);
+}
+
+/* Get |a| * |b| by schoolbook multiplication */
+lbig *lbig_mul_school(lbig *a, lbig *b) {
+
+  lbig *r = lbig_new(a->len + b->len);
+  for (int i = 0; i < a->len; i++) {
+    uint64_t carry = 0;
+    for (int j = 0; j < b->len; j++) {
+      carry += (uint64_t)a->d[i] * b->d[j] + r->d[i + j];
+      r->d[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    r->d[i + b->len] = (uint32_t)carry;
+  }
+  return lbig_trim(r);
+}
+
+/* Get |a| * |b|, splitting both at m limbs so that
+   a * b = z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0 */
+lbig *lbig_mul_mag(lbig *a, lbig *b) {
+
+  if (a->len < LBIG_KARATSUBA || b->len < LBIG_KARATSUBA) {
+    return lbig_mul_school(a, b);
+  }
+  int m = ((a->len > b->len ? a->len : b->len) + 1) / 2;
+  lbig *a0 = lbig_slice(a, 0, m);
+  lbig *a1 = lbig_slice(a, m, a->len);
+  lbig *b0 = lbig_slice(b, 0, m);
+  lbig *b1 = lbig_slice(b, m, b->len);
+  lbig *z0 = lbig_mul_mag(a0, b0);
+  lbig *z2 = lbig_mul_mag(a1, b1);
+  lbig *sa = lbig_add_mag(a0, a1);
+  lbig *sb = lbig_add_mag(b0, b1);
+  lbig *p = lbig_mul_mag(sa, sb);
+  lbig *q = lbig_sub_mag(p, z0);
+  lbig *z1 = lbig_sub_mag(q, z2);
+
+  lbig *r = lbig_new(a->len + b->len + 1);
+  lbig_add_into(r, z0, 0);
+  lbig_add_into(r, z1, m);
+  lbig_add_into(r, z2, 2 * m);
+
+  lbig *tmp[] = { a0, a1, b0, b1, z0, z2, sa, sb, p, q, z1 };
+  for (int i = 0; i < 11; i++) {
+    free(tmp[i]);
+  }
+  return lbig_trim(r);
+}
+
+lbig *lbig_mul(lbig *a, lbig *b) {
+
+  lbig *r = lbig_mul_mag(a, b);
+  r->neg = r->len && a->neg != b->neg;
+  return r;
+}
+
+/* Divide magnitude of b in place by a single limb, returning the remainder */
+uint32_t lbig_div_small(lbig *b, uint32_t y) {
+
+  uint64_t rem = 0;
+  for (int i = b->len - 1; i >= 0; i--) {
+    rem = (rem << 32) | b->d[i];
+    b->d[i] = (uint32_t)(rem / y);
+    rem %= y;
+  }
+  lbig_trim(b);
+  return (uint32_t)rem;
+}
+
+/* Divide a by non zero b, truncating toward zero like C does
+   (Knuth's algorithm D on normalized limbs) */
+void lbig_divmod(lbig *a, lbig *b, lbig **q, lbig **r) {
+
+  int neg = a->neg;
+  if (lbig_cmp_mag(a, b) < 0) {
+    *q = lbig_new(0);
+    *r = lbig_copy(a);
+    return;
+  }
+  if (b->len == 1) {
+    *q = lbig_copy(a);
+    *r = lbig_from_long(lbig_div_small(*q, b->d[0]));
+  } else {
+    int n = b->len;
+    int m = a->len - n;
+    int s = __builtin_clz(b->d[n - 1]);
+
+    /* shift both so the top limb of the divisor has its high bit set */
+    uint32_t *bn = malloc(sizeof(uint32_t) * n);
+    uint32_t *an = malloc(sizeof(uint32_t) * (a->len + 1));
+    for (int i = n - 1; i > 0; i--) {
+      bn[i] = (b->d[i] << s) | (s ? b->d[i - 1] >> (32 - s) : 0);
+    }
+    bn[0] = b->d[0] << s;
+    an[a->len] = s ? a->d[a->len - 1] >> (32 - s) : 0;
+    for (int i = a->len - 1; i > 0; i--) {
+      an[i] = (a->d[i] << s) | (s ? a->d[i - 1] >> (32 - s) : 0);
+    }
+    an[0] = a->d[0] << s;
+
+    *q = lbig_new(m + 1);
+    for (int j = m; j >= 0; j--) {
+      /* estimate the quotient limb from the top two limbs */
+      uint64_t num = ((uint64_t)an[j + n] << 32) | an[j + n - 1];
+      uint64_t qhat = num / bn[n - 1];
+      uint64_t rhat = num % bn[n - 1];
+      while (qhat >> 32 ||
+        qhat * bn[n - 2] > ((rhat << 32) | an[j + n - 2])) {
+        qhat--;
+        rhat += bn[n - 1];
+        if (rhat >> 32) {
+          break;
+        }
+      }
+      /* multiply and subtract */
+      int64_t borrow = 0;
+      int64_t t;
+      for (int i = 0; i < n; i++) {
+        uint64_t p = qhat * bn[i];
+        t = an[i + j] - borrow - (int64_t)(p & 0xffffffff);
+        an[i + j] = (uint32_t)t;
+        borrow = (int64_t)(p >> 32) - (t >> 32);
+      }
+      t = an[j + n] - borrow;
+      an[j + n] = (uint32_t)t;
+      /* add back when the estimate was one too large */
+      if (t < 0) {
+        qhat--;
+        uint64_t carry = 0;
+        for (int i = 0; i < n; i++) {
+          carry += (uint64_t)an[i + j] + bn[i];
+          an[i + j] = (uint32_t)carry;
+          carry >>= 32;
+        }
+        an[j + n] += (uint32_t)carry;
+      }
+      (*q)->d[j] = (uint32_t)qhat;
+    }
+
+    *r = lbig_new(n);
+    for (int i = 0; i < n; i++) {
+      (*r)->d[i] = (an[i] >> s) | (s ? an[i + 1] << (32 - s) : 0);
+    }
+    free(an);
+    free(bn);
+  }
+  lbig_trim(*q);
+  lbig_trim(*r);
+  (*q)->neg = (*q)->len && neg != b->neg;
+  (*r)->neg = (*r)->len && neg;
+}
+
+/* Get a mod m with the sign of a, m is non zero */
+lbig *lbig_mod(lbig *a, lbig *m) {
+
+  lbig *q;
+  lbig *r;
+  lbig_divmod(a, m, &q, &r);
+  free(q);
+  return r;
+}
+
+/* Get number of significant bits of magnitude */
+long lbig_bits(lbig *b) {
+
+  return b->len ? 32L * b->len - __builtin_clz(b->d[b->len - 1]) : 0;
+}
+
+/* Raise b to the non negative power e by squaring */
+lbig *lbig_pow(lbig *b, unsigned long e) {
+
+  lbig *r = lbig_from_long(1);
+  lbig *x = lbig_copy(b);
+  while (e) {
+    if (e & 1) {
+      lbig *t = lbig_mul(r, x);
+      free(r);
+      r = t;
+    }
+    e >>= 1;
+    if (e) {
+      lbig *t = lbig_mul(x, x);
+      free(x);
+      x = t;
+    }
+  }
+  free(x);
+  return r;
+}
+
+/* Parse optionally signed decimal digits, nine at a time */
+lbig *lbig_from_str(char *s) {
+
+  int neg = *s == '-';
+  s += neg;
+  int digits = strlen(s);
+  lbig *b = lbig_new(digits / 9 + 2);
+  b->len = 0;
+  for (int i = 0; i < digits;) {
+    int n = digits - i < 9 ? digits - i : 9;
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (int j = 0; j < n; j++, i++) {
+      chunk = chunk * 10 + (s[i] - '0');
+      scale *= 10;
+    }
+    /* b = b * scale + chunk */
+    uint64_t carry = chunk;
+    for (int j = 0; j < b->len; j++) {
+      carry += (uint64_t)b->d[j] * scale;
+      b->d[j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    if (carry) {
+      b->d[b->len++] = (uint32_t)carry;
+    }
+  }
+  b->neg = neg;
+  return lbig_trim(b);
+}
+
+/* Get decimal representation of bignum, to be freed by the caller */
+char *lbig_to_str(lbig *b) {
+
+  /* every limb holds less than ten decimal digits */
+  char *s = malloc(10 * b->len + 3);
+  char *p = s + 10 * b->len + 2;
+  *p = '\0';
+  lbig *x = lbig_copy(b);
+  do {
+    uint32_t chunk = lbig_div_small(x, 1000000000);
+    for (int i = 0; i < 9 && (x->len || chunk); i++) {
+      *--p = '0' + chunk % 10;
+      chunk /= 10;
+    }
+  } while (x->len);
+  if (!*p) {
+    *--p = '0';
+  }
+  if (b->neg) {
+    *--p = '-';
+  }
+  free(x);
+  memmove(s, p, strlen(p) + 1);
+  return s;
+}
+
+/* Dense matrix of doubles stored row major */
+typedef struct lmat {
+  int rows;
+  int cols;
+  double d[];
+} lmat;
+
+/* Side of the tiles transpose moves at once */
+#define LMAT_TILE 32
+
+/* Rows of b and columns of b and c matmul works on per block, so a block
+   of b stays in cache while the rows of a stream by */
+#define LMAT_BLOCK_K 64
+#define LMAT_BLOCK_J 256
+
+/* Allocate a matrix with uninitialised elements */
+lmat *lmat_new(int rows, int cols) {
+
+  lmat *m = malloc(sizeof(lmat) + sizeof(double) * rows * cols);
+  m->rows = rows;
+  m->cols = cols;
+  return m;
+}
+
+lmat *lmat_copy(lmat *m) {
+
+  size_t size = sizeof(lmat) + sizeof(double) * m->rows * m->cols;
+  return memcpy(malloc(size), m, size);
+}
+
+/* Transpose matrix tile by tile, so both reads and writes stay in cache */
+lmat *lmat_transpose(lmat *m) {
+
+  lmat *t = lmat_new(m->cols, m->rows);
+  for (int ii = 0; ii < m->rows; ii += LMAT_TILE) {
+    for (int jj = 0; jj < m->cols; jj += LMAT_TILE) {
+      int ie = ii + LMAT_TILE < m->rows ? ii + LMAT_TILE : m->rows;
+      int je = jj + LMAT_TILE < m->cols ? jj + LMAT_TILE : m->cols;
+      for (int i = ii; i < ie; i++) {
+        for (int j = jj; j < je; j++) {
+          t->d[j * m->rows + i] = m->d[i * m->cols + j];
+        }
+      }
+    }
+  }
+  return t;
+}
+
 /* Create a pointer to new Number lval */
 lval *lval_num(long x) {
 
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  lval *v = lval_alloc(LVAL_NUM);
   v->num = x;
   return v;
 }
 
+/* Create a pointer to new Number lval holding a bignum */
+lval *lval_big(lbig *b) {
+
+  lval *v = lval_alloc(LVAL_BIG);
+  v->big = b;
+  return v;
+}
+
+/* Turn a Number lval into a bignum */
+void lval_big_promote(lval *v) {
+
+  if (v->type == LVAL_NUM) {
+    v->big = lbig_from_long(v->num);
+    v->type = LVAL_BIG;
+  }
+}
+
+/* Turn a bignum back into a Number lval when it fits a machine word */
+void lval_big_demote(lval *v) {
+
+  long x;
+  if (v->type == LVAL_BIG && lbig_to_long(v->big, &x)) {
+    free(v->big);
+    v->num = x;
+    v->type = LVAL_NUM;
+  }
+}
+
+/* Create a pointer to new Matrix lval */
+lval *lval_mat(lmat *m) {
+
+  lval *v = lval_alloc(LVAL_MAT);
+  v->mat = m;
+  return v;
+}
+
+/* Create a pointer to new Double lval */
+lval *lval_dbl(double x) {
+
+  lval *v = lval_alloc(LVAL_DBL);
+  v->dbl = x;
+  return v;
+}
+
 /* Create a pointer to new Error lval */
 lval *lval_err(char *m) {
 
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval *v = lval_alloc(LVAL_ERR);
   v->err = malloc(strlen(m) + 1);
   strcpy(v->err, m);
   return v;
 }
 
-/* Create a pointer to new Symbol lval */
+/* Open addressing hash set holding one copy of every symbol name */
+struct {
+  char **names;
+  int count;
+  int cap;
+} lval_symtab;
+
+/* Get slot of symbol name in the symbol table, hashed with FNV-1a */
+char **lval_symtab_slot(char *s) {
+
+  unsigned long long h = 14695981039346656037ULL;
+  for (char *c = s; *c; c++) {
+    h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+  }
+  int i = h & (lval_symtab.cap - 1);
+  while (lval_symtab.names[i] && strcmp(lval_symtab.names[i], s) != 0) {
+    i = (i + 1) & (lval_symtab.cap - 1);
+  }
+  return &lval_symtab.names[i];
+}
+
+/* Get the canonical copy of symbol name, adding it on first use */
+char *lval_intern(char *s) {
+
+  if (lval_symtab.count * 2 >= lval_symtab.cap) {
+    char **old = lval_symtab.names;
+    int cap = lval_symtab.cap;
+    lval_symtab.cap = cap ? cap * 2 : 64;
+    lval_symtab.names = calloc(lval_symtab.cap, sizeof(char *));
+    for (int i = 0; i < cap; i++) {
+      if (old[i]) {
+        *lval_symtab_slot(old[i]) = old[i];
+      }
+    }
+    free(old);
+  }
+  char **slot = lval_symtab_slot(s);
+  if (!*slot) {
+    *slot = malloc(strlen(s) + 1);
+    strcpy(*slot, s);
+    lval_symtab.count++;
+  }
+  return *slot;
+}
+
+/* Free every interned symbol name */
+void lval_symtab_release(void) {
+
+  for (int i = 0; i < lval_symtab.cap; i++) {
+    free(lval_symtab.names[i]);
+  }
+  free(lval_symtab.names);
+  memset(&lval_symtab, 0, sizeof(lval_symtab));
+}
+
+/* Create a pointer to new Function lval calling builtin op */
+lval *lval_fun(lbuiltin fun, int op) {
+
+  lval *v = lval_alloc(LVAL_FUN);
+  v->fun = fun;
+  v->op = op;
+  return v;
+}
+
+/* Create a pointer to new Symbol lval, its name is interned */
 lval *lval_sym(char *s) {
 
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  lval *v = lval_alloc(LVAL_SYM);
+  v->sym = lval_intern(s);
   return v;
 }
 
 /* Create a pointer to new Sexpr lval */
 lval *lval_sexpr(void) {
 
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval *v = lval_alloc(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -57,42 +892,185 @@ lval *lval_sexpr(void) {
 /* Create a pointer to new Qexpr lval */
 lval *lval_qexpr(void) {
 
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval *v = lval_alloc(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
-lval *lval_read_num(mpc_ast_t *t) {
+/* Header stored in front of every expression cell array. Popping the
+   first cell slides the header forward over it, so cap counts the cells
+   after the header and off the slots skipped since the allocation start */
+typedef struct {
+  int cap;
+  int off;
+} lval_cells;
 
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
+/* Smallest cell array allocated for a non empty expression */
+#define LVAL_MIN_CAP 4
+
+/* Get header in front of the cell array of expression */
+#define LVAL_CELLS(v) ((lval_cells *)(v)->cell - 1)
+
+/* Get start of the allocation holding the cell array of expression */
+void *lval_cells_base(lval *v) {
+
+  return (char *)LVAL_CELLS(v) - sizeof(lval *) * LVAL_CELLS(v)->off;
 }
 
-/* Add lval to another lval */
-lval *lval_add(lval *v, lval *x) {
+/* Get number of cells allocated for expression, including popped slots */
+int lval_cap(lval *v) {
 
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  v->cell[v->count - 1] = x;
-  return v;
+  return v->cell ? LVAL_CELLS(v)->cap + LVAL_CELLS(v)->off : 0;
 }
 
-/* Create lval from parser output */
-lval *lval_read(mpc_ast_t *t) {
+/* Resize cell array of expression to hold cap cells, leaving front free
+   slots before the first cell */
+void lval_resize(lval *v, int cap, int front) {
 
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
-  }
-  if (strstr(t->tag, "symbol")) {
-    return lval_sym(t->contents);
+  lval_cells *h = NULL;
+  if (v->cell) {
+    h = lval_cells_base(v);
+    memmove(h + 1, v->cell, sizeof(lval *) * v->count);
   }
+  h = realloc(h, sizeof(lval_cells) + sizeof(lval *) * cap);
+  lval **cell = (lval **)(h + 1) + front;
+  memmove(cell, h + 1, sizeof(lval *) * v->count);
+  v->cell = cell;
+  LVAL_CELLS(v)->cap = cap - front;
+  LVAL_CELLS(v)->off = front;
+}
 
-  lval *x = NULL;
-  if (strstr(t->tag, ">")) {
-    x = lval_sexpr();
+/* Make room for at least n cells, doubling capacity when growing */
+void lval_reserve(lval *v, int n) {
+
+  if (!v->cell || n > LVAL_CELLS(v)->cap) {
+    int cap = lval_cap(v);
+    /* reuse popped slots while at most half of the array is live */
+    if (n > cap || v->count > cap / 2) {
+      cap = cap ? cap * 2 : LVAL_MIN_CAP;
+    }
+    while (cap < n) {
+      cap *= 2;
+    }
+    lval_resize(v, cap, 0);
+  }
+}
+
+/* Make room for n cells in front of the first cell of expression */
+void lval_reserve_front(lval *v, int n) {
+
+  if (v->cell && n <= LVAL_CELLS(v)->off) {
+    return;
+  }
+  int cap = lval_cap(v) ? lval_cap(v) * 2 : LVAL_MIN_CAP;
+  while (cap < v->count + n) {
+    cap *= 2;
+  }
+  /* split the spare slots between both ends */
+  lval_resize(v, cap, n + (cap - v->count - n) / 2);
+}
+
+/* Shrink cell array once less than a quarter of it is in use */
+void lval_compact(lval *v) {
+
+  int cap = lval_cap(v);
+  if (cap > LVAL_MIN_CAP && v->count < cap / 4) {
+    lval_resize(v, v->count > LVAL_MIN_CAP ? v->count : LVAL_MIN_CAP, 0);
+  }
+}
+
+lval *lval_read_num(char *s) {
+
+  errno = 0;
+  long x = strtol(s, NULL, 10);
+  return errno != ERANGE ? lval_num(x) : lval_big(lbig_from_str(s));
+}
+
+lval *lval_own(lval *v);
+
+/* Add lval to another lval */
+lval *lval_add(lval *v, lval *x) {
+
+  v = lval_own(v);
+  lval_reserve(v, v->count + 1);
+  v->cell[v->count++] = x;
+  return v;
+}
+
+void lval_del(lval *v);
+
+/* Pack Qexpr holding only numbers of one kind into a vector, in place */
+lval *lval_vec_pack(lval *v) {
+
+  if (v->count == 0) {
+    return v;
+  }
+  int t = v->cell[0]->type;
+  if (t != LVAL_NUM && t != LVAL_DBL) {
+    return v;
+  }
+  for (int i = 1; i < v->count; i++) {
+    if (v->cell[i]->type != t) {
+      return v;
+    }
+  }
+  v = lval_own(v);
+  for (int i = 0; i < v->count; i++) {
+    lval *x = v->cell[i];
+    if (t == LVAL_DBL) {
+      v->dbls[i] = x->dbl;
+    } else {
+      v->nums[i] = x->num;
+    }
+    lval_del(x);
+  }
+  v->type = LVAL_VEC;
+  if (t == LVAL_DBL) {
+    v->flags |= LVAL_DOUBLES;
+  }
+  return v;
+}
+
+/* Unpack vector into a Qexpr of numbers, in place */
+lval *lval_vec_expand(lval *v) {
+
+  v = lval_own(v);
+  int dbl = v->flags & LVAL_DOUBLES;
+  for (int i = 0; i < v->count; i++) {
+    v->cell[i] = dbl ? lval_dbl(v->dbls[i]) : lval_num(v->nums[i]);
+  }
+  v->type = LVAL_QEXPR;
+  v->flags &= ~LVAL_DOUBLES;
+  return v;
+}
+
+lval *lval_read_sym(char *s);
+
+/* Check for parser output that is punctuation rather than an expression */
+int lval_read_skip(mpc_ast_t *t) {
+
+  return strcmp(t->contents, "(") == 0 || strcmp(t->contents, ")") == 0
+    || strcmp(t->contents, "{") == 0 || strcmp(t->contents, "}") == 0
+    || strcmp(t->tag, "regex") == 0;
+}
+
+/* Create lval from parser output */
+lval *lval_read(mpc_ast_t *t) {
+
+  if (strstr(t->tag, "decimal")) {
+    return lval_dbl(strtod(t->contents, NULL));
+  }
+  if (strstr(t->tag, "number")) {
+    return lval_read_num(t->contents);
+  }
+  if (strstr(t->tag, "symbol")) {
+    return lval_read_sym(t->contents);
+  }
+
+  lval *x = NULL;
+  if (strstr(t->tag, ">")) {
+    x = lval_sexpr();
   }
   if (strstr(t->tag, "sexpr")) {
     x = lval_sexpr();
@@ -102,336 +1080,3405 @@ lval *lval_read(mpc_ast_t *t) {
   }
 
   for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) {
+    if (lval_read_skip(t->children[i])) {
       continue;
     }
-    if (strcmp(t->children[i]->contents, ")") == 0) {
-      continue;
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+
+  if (x->type == LVAL_QEXPR) {
+    x = lval_vec_pack(x);
+  }
+  return x;
+}
+
+/* Parsers of the direct reader, which builds lval values while parsing
+   instead of an mpc_ast_t for lval_read to walk */
+struct {
+  mpc_parser_t *expr;
+  mpc_parser_t *lispty;
+} lval_reader;
+
+/* Read matched number or decimal, freeing the match. A single token
+   matches both, where the grammar tries decimal and then number */
+mpc_val_t *lval_readf_num(mpc_val_t *s) {
+
+  char *t = s;
+  lval *x = t[strspn(t, "-0123456789")] ? lval_dbl(strtod(t, NULL))
+    : lval_read_num(t);
+  free(s);
+  return x;
+}
+
+/* Read matched symbol, freeing the match */
+mpc_val_t *lval_readf_sym(mpc_val_t *s) {
+
+  lval *x = lval_read_sym(s);
+  free(s);
+  return x;
+}
+
+/* Collect the values of n expressions into a Sexpr */
+mpc_val_t *lval_readf_exprs(int n, mpc_val_t **xs) {
+
+  lval *x = lval_sexpr();
+  lval_reserve(x, n);
+  memcpy(x->cell, xs, sizeof(lval *) * n);
+  x->count = n;
+  return x;
+}
+
+/* Get the expressions between two delimiters, freeing the delimiters */
+mpc_val_t *lval_readf_sexpr(int n, mpc_val_t **xs) {
+
+  free(xs[0]);
+  free(xs[2]);
+  return xs[1];
+}
+
+/* Get the expressions between braces as a Qexpr */
+mpc_val_t *lval_readf_qexpr(int n, mpc_val_t **xs) {
+
+  lval *x = lval_readf_sexpr(n, xs);
+  x->type = LVAL_QEXPR;
+  return lval_vec_pack(x);
+}
+
+/* Delete value of a parser that failed later on */
+void lval_readf_del(mpc_val_t *x) {
+
+  lval_del(x);
+}
+
+/* Build the direct reader for the same language as the grammar in main,
+   with the same tokens tried in the same order */
+void lval_reader_init(void) {
+
+  /* names of the builtins, tried in order */
+  mpc_parser_t *symbol = mpc_string(lval_fun_names[LFUN_COUNT - 1]);
+  for (int i = LFUN_COUNT - 2; i >= 0; i--) {
+    symbol = mpc_or(2, mpc_string(lval_fun_names[i]), symbol);
+  }
+  /* flattens the nested alternatives into one */
+  mpc_optimise(symbol);
+
+  lval_reader.expr = mpc_new("expr");
+  lval_reader.lispty = mpc_new("lispty");
+  /* expressions go first, no other alternative starts with a bracket */
+  mpc_define(lval_reader.expr, mpc_or(4,
+    mpc_and(3, lval_readf_sexpr, mpc_tok(mpc_char('(')),
+      mpc_many(lval_readf_exprs, lval_reader.expr), mpc_tok(mpc_char(')')),
+      free, lval_readf_del),
+    mpc_and(3, lval_readf_qexpr, mpc_tok(mpc_char('{')),
+      mpc_many(lval_readf_exprs, lval_reader.expr), mpc_tok(mpc_char('}')),
+      free, lval_readf_del),
+    mpc_apply(mpc_tok(mpc_re(
+      "-?(inf|nan|[0-9]+(\\.[0-9]+([eE][+-]?[0-9]+)?|[eE][+-]?[0-9]+)?)")),
+      lval_readf_num),
+    mpc_apply(mpc_tok(symbol), lval_readf_sym)));
+  mpc_define(lval_reader.lispty, mpc_and(3, lval_readf_sexpr,
+    mpc_tok(mpc_re("^")), mpc_many(lval_readf_exprs, lval_reader.expr),
+    mpc_tok(mpc_re("$")), free, lval_readf_del));
+}
+
+/* Free the parsers of the direct reader */
+void lval_reader_release(void) {
+
+  mpc_cleanup(2, lval_reader.expr, lval_reader.lispty);
+}
+
+/* Read input through the mpc parsers of the direct reader instead of
+   lval_scan, which is checked against them */
+int lval_use_mpc = 0;
+
+/* Check for a character the grammar skips between tokens */
+int lval_scan_space(char c) {
+
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f'
+    || c == '\v';
+}
+
+/* Skip the digits at s, stopping at end */
+const char *lval_scan_digits(const char *s, const char *end) {
+
+  while (s < end && *s >= '0' && *s <= '9') {
+    s++;
+  }
+  return s;
+}
+
+/* Skip the exponent at s when it has digits */
+const char *lval_scan_exp(const char *s, const char *end) {
+
+  if (s == end || (*s != 'e' && *s != 'E')) {
+    return s;
+  }
+  const char *t = s + 1;
+  if (t < end && (*t == '+' || *t == '-')) {
+    t++;
+  }
+  const char *d = lval_scan_digits(t, end);
+  return d > t ? d : s;
+}
+
+/* Length of the number or decimal at s, or 0 when there is none. Same
+   token as the decimal regex of the grammar, or else the number regex */
+size_t lval_scan_num_len(const char *s, const char *end) {
+
+  const char *t = s < end && *s == '-' ? s + 1 : s;
+  if (end - t >= 3 && (memcmp(t, "inf", 3) == 0 || memcmp(t, "nan", 3) == 0)) {
+    return t + 3 - s;
+  }
+  const char *d = lval_scan_digits(t, end);
+  if (d == t) {
+    return 0;
+  }
+  if (d < end && *d == '.') {
+    const char *f = lval_scan_digits(d + 1, end);
+    if (f > d + 1) {
+      d = lval_scan_exp(f, end);
     }
-    if (strcmp(t->children[i]->contents, "{") == 0) {
-      continue;
+  } else {
+    d = lval_scan_exp(d, end);
+  }
+  return d - s;
+}
+
+/* Read the number or decimal of n characters at s */
+lval *lval_scan_num(const char *s, size_t n) {
+
+  char local[64];
+  char *t = n < sizeof(local) ? local : malloc(n + 1);
+  memcpy(t, s, n);
+  t[n] = '\0';
+  lval *x = t[strspn(t, "-0123456789")] ? lval_dbl(strtod(t, NULL))
+    : lval_read_num(t);
+  if (t != local) {
+    free(t);
+  }
+  return x;
+}
+
+/* Opcode of the builtin whose name is at s, or -1. Names are tried in
+   the order of the symbol rule, like the grammar does */
+int lval_scan_sym(const char *s, const char *end) {
+
+  for (int i = 0; i < LFUN_COUNT; i++) {
+    const char *name = lval_fun_names[i];
+    size_t n = strlen(name);
+    if (*s == *name && n <= (size_t)(end - s) && memcmp(s, name, n) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Check for a bracket, which is a token of its own */
+int lval_scan_bracket(char c) {
+
+  return c == '(' || c == ')' || c == '{' || c == '}';
+}
+
+/* Bytes the tokenizer classifies at a time, one bit each */
+#define LVAL_SCAN_BLOCK 64
+
+/* Bytes the tokenizer indexes before the reader consumes their tokens */
+#define LVAL_SCAN_WINDOW 65536
+
+/* Set the bits of the whitespace and of the brackets among the
+   LVAL_SCAN_BLOCK bytes at s */
+void lval_scan_classify(const char *s, uint64_t *space, uint64_t *brackets) {
+
+  uint64_t sp = 0;
+  uint64_t br = 0;
+  for (int i = 0; i < LVAL_SCAN_BLOCK; i++) {
+    sp |= (uint64_t)lval_scan_space(s[i]) << i;
+    br |= (uint64_t)lval_scan_bracket(s[i]) << i;
+  }
+  *space = sp;
+  *brackets = br;
+}
+
+/* Index the tokens among the n bytes at s into out, returning how many.
+   A token starts at every bracket and where a run of other non-space
+   bytes begins, and atom carries whether such a run goes on from the
+   block before. The last block is padded with spaces. Runs can hold
+   several tokens, like "1-2", which the reader splits */
+#define LVAL_SCAN_INDEX(classify)                                       \
+  size_t k = 0;                                                         \
+  for (size_t b = 0; b < n; b += LVAL_SCAN_BLOCK) {                     \
+    uint64_t space, brackets;                                           \
+    if (n - b >= LVAL_SCAN_BLOCK) {                                     \
+      classify(s + b, &space, &brackets);                               \
+    } else {                                                            \
+      char last[LVAL_SCAN_BLOCK];                                       \
+      memset(last, ' ', sizeof(last));                                  \
+      memcpy(last, s + b, n - b);                                       \
+      classify(last, &space, &brackets);                                \
+    }                                                                   \
+    uint64_t atoms = ~(space | brackets);                               \
+    uint64_t starts = brackets | (atoms & ~(atoms << 1 | *atom));       \
+    *atom = atoms >> 63;                                                \
+    while (starts) {                                                    \
+      out[k++] = b + __builtin_ctzll(starts);                           \
+      starts &= starts - 1;                                             \
+    }                                                                   \
+  }                                                                     \
+  return k;
+
+/* Index tokens a byte at a time */
+size_t lval_scan_index(const char *s, size_t n, uint64_t *atom,
+  uint32_t *out) {
+
+  LVAL_SCAN_INDEX(lval_scan_classify)
+}
+
+#ifdef LVAL_AVX2
+/* Classify 16 bytes at a time. Tab to carriage return are the bytes at
+   most 4 above a tab */
+void lval_scan_classify_sse2(const char *s, uint64_t *space,
+  uint64_t *brackets) {
+
+  uint64_t sp = 0;
+  uint64_t br = 0;
+  for (int i = 0; i < LVAL_SCAN_BLOCK; i += 16) {
+    __m128i c = _mm_loadu_si128((__m128i *)(s + i));
+    __m128i tab = _mm_sub_epi8(c, _mm_set1_epi8('\t'));
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+      _mm_cmpeq_epi8(_mm_min_epu8(tab, _mm_set1_epi8(4)), tab));
+    __m128i bs = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('(')),
+        _mm_cmpeq_epi8(c, _mm_set1_epi8(')'))),
+      _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('{')),
+        _mm_cmpeq_epi8(c, _mm_set1_epi8('}'))));
+    sp |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << i;
+    br |= (uint64_t)(uint16_t)_mm_movemask_epi8(bs) << i;
+  }
+  *space = sp;
+  *brackets = br;
+}
+
+/* Index tokens classifying 16 bytes at a time, which every x86-64 has */
+size_t lval_scan_index_sse2(const char *s, size_t n, uint64_t *atom,
+  uint32_t *out) {
+
+  LVAL_SCAN_INDEX(lval_scan_classify_sse2)
+}
+
+/* Classify 32 bytes at a time, like lval_scan_classify_sse2 */
+__attribute__((target("avx2")))
+void lval_scan_classify_avx2(const char *s, uint64_t *space,
+  uint64_t *brackets) {
+
+  uint64_t sp = 0;
+  uint64_t br = 0;
+  for (int i = 0; i < LVAL_SCAN_BLOCK; i += 32) {
+    __m256i c = _mm256_loadu_si256((__m256i *)(s + i));
+    __m256i tab = _mm256_sub_epi8(c, _mm256_set1_epi8('\t'));
+    __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+      _mm256_cmpeq_epi8(_mm256_min_epu8(tab, _mm256_set1_epi8(4)), tab));
+    __m256i bs = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('(')),
+        _mm256_cmpeq_epi8(c, _mm256_set1_epi8(')'))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('{')),
+        _mm256_cmpeq_epi8(c, _mm256_set1_epi8('}'))));
+    sp |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << i;
+    br |= (uint64_t)(uint32_t)_mm256_movemask_epi8(bs) << i;
+  }
+  *space = sp;
+  *brackets = br;
+}
+
+/* Index tokens classifying 32 bytes at a time */
+__attribute__((target("avx2")))
+size_t lval_scan_index_avx2(const char *s, size_t n, uint64_t *atom,
+  uint32_t *out) {
+
+  LVAL_SCAN_INDEX(lval_scan_classify_avx2)
+}
+#endif
+
+/* Tokenizer used by lval_scan, picked for the cpu by lval_vec_init */
+#ifdef LVAL_AVX2
+size_t (*lval_scan_tokens)(const char *s, size_t n, uint64_t *atom,
+  uint32_t *out) = lval_scan_index_sse2;
+#else
+size_t (*lval_scan_tokens)(const char *s, size_t n, uint64_t *atom,
+  uint32_t *out) = lval_scan_index;
+#endif
+
+/* Read the n characters at s into a Sexpr of their expressions in one
+   pass, recognizing the language of the grammar in main without mpc.
+   lval_scan_tokens indexes where the tokens start a window at a time,
+   and runs of several tokens are split here. Open expressions wait on a
+   work stack, with the bracket closing them, so nesting is only limited
+   by memory. NULL when input does not match */
+lval *lval_scan(const char *s, size_t n) {
+
+  const char *end = s + n;
+  uint32_t *index = malloc(sizeof(uint32_t)
+    * (n < LVAL_SCAN_WINDOW ? n + 1 : LVAL_SCAN_WINDOW));
+  uint64_t atom = 0;
+  lval *x = lval_sexpr();
+  lval_stack st;
+  lval_stack_init(&st);
+  int ok = 1;
+  for (size_t w = 0; ok && w < n; w += LVAL_SCAN_WINDOW) {
+    const char *window = s + w;
+    size_t count = lval_scan_tokens(window,
+      n - w < LVAL_SCAN_WINDOW ? n - w : LVAL_SCAN_WINDOW, &atom, index);
+    for (size_t k = 0; ok && k < count; k++) {
+      const char *p = window + index[k];
+      if (*p == '(' || *p == '{') {
+        lval_stack_push(&st, x, *p == '(' ? ')' : '}');
+        x = lval_sexpr();
+      } else if (*p == ')' || *p == '}') {
+        ok = st.count && st.frames[st.count - 1].i == *p;
+        if (ok) {
+          if (*p == '}') {
+            x->type = LVAL_QEXPR;
+            x = lval_vec_pack(x);
+          }
+          x = lval_add(st.frames[--st.count].v, x);
+        }
+      } else {
+        /* tokens of the run, which never reach past it */
+        do {
+          size_t len;
+          int op;
+          if ((len = lval_scan_num_len(p, end))) {
+            x = lval_add(x, lval_scan_num(p, len));
+            p += len;
+          } else if ((op = lval_scan_sym(p, end)) >= 0) {
+            x = lval_add(x, lval_read_sym(lval_fun_names[op]));
+            p += strlen(lval_fun_names[op]);
+          } else {
+            ok = 0;
+          }
+        } while (ok && p < end && !lval_scan_space(*p)
+          && !lval_scan_bracket(*p));
+      }
+    }
+  }
+
+  /* unclosed expressions are an error too */
+  if (!ok || st.count) {
+    lval_del(x);
+    while (st.count) {
+      lval_del(st.frames[--st.count].v);
+    }
+    x = NULL;
+  }
+  lval_stack_release(&st);
+  free(index);
+  return x;
+}
+
+/* Read file into a string, to be freed by the caller, or NULL */
+char *lval_slurp(const char *path) {
+
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  if (n < 0) {
+    fclose(f);
+    return NULL;
+  }
+  rewind(f);
+  char *s = malloc(n + 1);
+  s[fread(s, 1, n, f)] = '\0';
+  fclose(f);
+  return s;
+}
+
+/* Finish a parse the reader failed with ok and r from the grammar, which
+   recognizes the same language, for its error naming the rules it
+   expected. When the grammar accepts, the reader is out of sync with it,
+   which is reported before reading the tree of the grammar instead */
+int lval_parse_retry(const char *name, int ok, mpc_result_t *r) {
+
+  if (!ok) {
+    return 0;
+  }
+  fprintf(stderr, "%s: reader rejected input the grammar accepts!\n", name);
+  mpc_ast_t *t = r->output;
+  r->output = lval_read(t);
+  mpc_ast_delete(t);
+  return 1;
+}
+
+/* Read the expressions of input into a Sexpr */
+int lval_parse(const char *name, const char *input, mpc_parser_t *grammar,
+  mpc_result_t *r) {
+
+  if (!lval_use_mpc) {
+    /* mpc also stops at a nul character */
+    r->output = lval_scan(input, strlen(input));
+    if (r->output) {
+      return 1;
+    }
+  } else if (mpc_parse(name, input, lval_reader.lispty, r)) {
+    return 1;
+  } else {
+    mpc_err_delete(r->error);
+  }
+  return lval_parse_retry(name, mpc_parse(name, input, grammar, r), r);
+}
+
+/* Read the expressions of the file at path into a Sexpr, like lval_parse */
+int lval_parse_file(const char *path, mpc_parser_t *grammar,
+  mpc_result_t *r) {
+
+  if (!lval_use_mpc) {
+    char *s = lval_slurp(path);
+    r->output = s ? lval_scan(s, strlen(s)) : NULL;
+    free(s);
+    if (r->output) {
+      return 1;
+    }
+  } else if (mpc_parse_contents(path, lval_reader.lispty, r)) {
+    return 1;
+  } else {
+    mpc_err_delete(r->error);
+  }
+  return lval_parse_retry(path, mpc_parse_contents(path, grammar, r), r);
+}
+
+/* Free what a dead node owns, without touching its children */
+void lval_release(lval *v) {
+
+  switch (v->type) {
+    case LVAL_BIG:
+      free(v->big);
+      break;
+    case LVAL_MAT:
+      free(v->mat);
+      break;
+    case LVAL_ERR:
+      free(v->err);
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    case LVAL_VEC:
+      if (v->cell) {
+        free(lval_cells_base(v));
+      }
+      break;
+  }
+}
+
+/* Drop one owner of lval, deleting it with the last one.
+   Garbage is left to the collector once it is enabled */
+void lval_del(lval *v) {
+
+  if (lval_gc.enabled || --v->refs) {
+    return;
+  }
+  lval_stack s;
+  lval_stack_init(&s);
+  while (v) {
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->count) {
+      lval_stack_push(&s, v, 0);
+    } else {
+      lval_release(v);
+      lval_free(v);
+    }
+
+    /* drop the next child of the innermost expression, deleting the
+       expressions whose children are all dropped */
+    v = NULL;
+    while (s.count && !v) {
+      lval_frame *f = &s.frames[s.count - 1];
+      if (f->i < f->v->count) {
+        lval *x = f->v->cell[f->i++];
+        v = --x->refs ? NULL : x;
+      } else {
+        lval_release(f->v);
+        lval_free(f->v);
+        s.count--;
+      }
     }
-    if (strcmp(t->children[i]->contents, "}") == 0) {
+  }
+  lval_stack_release(&s);
+}
+
+lval *lval_copy(lval *v);
+
+/* Copy lval node, sharing the children of expressions */
+lval *lval_clone(lval *v) {
+
+  lval *x = lval_alloc(v->type);
+  switch (v->type) {
+    case LVAL_NUM:
+      x->num = v->num;
+      break;
+    case LVAL_BIG:
+      x->big = lbig_copy(v->big);
+      break;
+    case LVAL_DBL:
+      x->dbl = v->dbl;
+      break;
+    case LVAL_MAT:
+      x->mat = lmat_copy(v->mat);
+      break;
+    case LVAL_SYM:
+      x->sym = v->sym;
+      break;
+    case LVAL_FUN:
+      x->fun = v->fun;
+      x->op = v->op;
+      break;
+    case LVAL_ERR:
+      x->err = malloc(strlen(v->err) + 1);
+      strcpy(x->err, v->err);
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      x->count = 0;
+      x->cell = NULL;
+      lval_reserve(x, v->count);
+      for (int i = 0; i < v->count; i++) {
+        x->cell[i] = lval_copy(v->cell[i]);
+      }
+      x->count = v->count;
+      break;
+    case LVAL_VEC:
+      x->flags |= v->flags & LVAL_DOUBLES;
+      x->count = 0;
+      x->cell = NULL;
+      lval_reserve(x, v->count);
+      memcpy(x->nums, v->nums, sizeof(long) * v->count);
+      x->count = v->count;
+      break;
+  }
+  return x;
+}
+
+/* Get a new owner of lval, sharing it unless it has too many owners */
+lval *lval_copy(lval *v) {
+
+  if (v->refs == LVAL_REFS_MAX) {
+    return lval_clone(v);
+  }
+  v->refs++;
+  return v;
+}
+
+/* Get lval that can be changed in place, cloning it if it is shared */
+lval *lval_own(lval *v) {
+
+  if (v->refs == 1) {
+    return v;
+  }
+  lval *x = lval_clone(v);
+  lval_del(v);
+  return x;
+}
+
+/* Get lval without deleting lval children, capacity is kept.
+   v must be owned */
+lval *lval_pop(lval *v, int i) {
+
+  lval *x = v->cell[i];
+  if (i == 0) {
+    /* slide the header over the first cell instead of moving the rest */
+    lval_cells h = *LVAL_CELLS(v);
+    h.cap--;
+    h.off++;
+    v->cell++;
+    *LVAL_CELLS(v) = h;
+  } else {
+    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+  }
+  v->count--;
+  return x;
+}
+
+/* Get lval (delet children) */
+lval *lval_take(lval *v, int i) {
+
+  /* a shared expression stays intact for its other owners */
+  lval *x = v->refs == 1 ? lval_pop(v, i) : lval_copy(v->cell[i]);
+  lval_del(v);
+  return x;
+}
+
+
+/* Delete cells from index i to the end of expression in one pass */
+lval *lval_truncate(lval *v, int i) {
+
+  v = lval_own(v);
+  for (int j = i; j < v->count && v->type != LVAL_VEC; j++) {
+    lval_del(v->cell[j]);
+  }
+  v->count = i;
+  return v;
+}
+
+/* Move all cells of x in front of the first cell of y */
+lval *lval_prepend(lval *x, lval *y) {
+
+  x = lval_own(x);
+  y = lval_own(y);
+  lval_reserve_front(y, x->count);
+  lval_cells h = *LVAL_CELLS(y);
+  h.cap += x->count;
+  h.off -= x->count;
+  y->cell -= x->count;
+  *LVAL_CELLS(y) = h;
+  memcpy(y->cell, x->cell, sizeof(lval *) * x->count);
+  y->count += x->count;
+  x->count = 0;
+  lval_del(x);
+  return y;
+}
+
+/* Join lval, keeping the longer list in place and moving the other one
+   into it with a single copy */
+lval *lval_join(lval *x ,lval *y) {
+
+  if (x->count == 0) {
+    lval_del(x);
+    return y;
+  }
+  if (y->count == 0) {
+    lval_del(y);
+    return x;
+  }
+  if (y->count > x->count) {
+    return lval_prepend(x, y);
+  }
+  x = lval_own(x);
+  y = lval_own(y);
+  lval_reserve(x, x->count + y->count);
+  memcpy(&x->cell[x->count], y->cell, sizeof(lval *) * y->count);
+  x->count += y->count;
+  y->count = 0;
+  lval_del(y);
+  return x;
+}
+
+/* Start collecting garbage instead of deleting values eagerly */
+void lval_gc_enable(void) {
+
+  lval_gc.nursery = malloc(sizeof(lval) * LVAL_NURSERY_NODES);
+  lval_gc.enabled = 1;
+}
+
+/* Register a variable holding a live value, updated when it is promoted */
+void lval_gc_root(lval **v) {
+
+  if (lval_gc.root_count == lval_gc.root_cap) {
+    lval_gc.root_cap = lval_gc.root_cap ? lval_gc.root_cap * 2 : 64;
+    lval_gc.roots = realloc(lval_gc.roots, sizeof(lval **) * lval_gc.root_cap);
+  }
+  lval_gc.roots[lval_gc.root_count++] = v;
+}
+
+/* Unregister the last n roots */
+void lval_gc_unroot(int n) {
+
+  lval_gc.root_count -= n;
+}
+
+/* Register a work stack whose frames hold live values */
+void lval_gc_root_stack(lval_stack *s) {
+
+  if (lval_gc.stack_count == lval_gc.stack_cap) {
+    lval_gc.stack_cap = lval_gc.stack_cap ? lval_gc.stack_cap * 2 : 16;
+    lval_gc.stacks = realloc(lval_gc.stacks,
+      sizeof(lval_stack *) * lval_gc.stack_cap);
+  }
+  lval_gc.stacks[lval_gc.stack_count++] = s;
+}
+
+/* Unregister the last work stack */
+void lval_gc_unroot_stack(void) {
+
+  lval_gc.stack_count--;
+}
+
+/* Mark a reachable node, promoting it out of the nursery. Sets fresh when
+   the node was not marked before, so its children are still to visit */
+lval *lval_gc_mark(lval *v, int *fresh) {
+
+  *fresh = 0;
+  if (v >= lval_gc.nursery && v < lval_gc.nursery + LVAL_NURSERY_NODES) {
+    if (v->flags & LVAL_FORWARDED) {
+      return v->next;
+    }
+    lval *x = lval_slab_alloc(v->type);
+    *x = *v;
+    v->flags = LVAL_FORWARDED;
+    v->next = x;
+    lval_gc.promoted++;
+    v = x;
+  } else if (v->flags & LVAL_MARKED) {
+    return v;
+  }
+  v->flags |= LVAL_MARKED;
+  *fresh = 1;
+  return v;
+}
+
+/* Mark a reachable value and everything it holds */
+lval *lval_gc_visit(lval *v) {
+
+  int fresh;
+  v = lval_gc_mark(v, &fresh);
+  if (!fresh || (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)) {
+    return v;
+  }
+  lval_stack s;
+  lval_stack_init(&s);
+  lval_stack_push(&s, v, 0);
+  while (s.count) {
+    lval_frame *f = &s.frames[s.count - 1];
+    if (f->i == f->v->count) {
+      s.count--;
+      continue;
+    }
+    lval *x = lval_gc_mark(f->v->cell[f->i], &fresh);
+    f->v->cell[f->i++] = x;
+    if (fresh && (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR)) {
+      lval_stack_push(&s, x, 0);
+    }
+  }
+  lval_stack_release(&s);
+  return v;
+}
+
+/* Promote live nursery nodes and sweep dead nodes of the pool */
+void lval_gc_collect(void) {
+
+  clock_t start = clock();
+  for (int i = 0; i < lval_gc.root_count; i++) {
+    if (*lval_gc.roots[i]) {
+      *lval_gc.roots[i] = lval_gc_visit(*lval_gc.roots[i]);
+    }
+  }
+  for (int i = 0; i < lval_gc.stack_count; i++) {
+    lval_stack *s = lval_gc.stacks[i];
+    for (int j = 0; j < s->count; j++) {
+      s->frames[j].v = lval_gc_visit(s->frames[j].v);
+    }
+  }
+  for (int i = 0; i < lval_gc.used; i++) {
+    if (!(lval_gc.nursery[i].flags & LVAL_FORWARDED)) {
+      lval_release(&lval_gc.nursery[i]);
+      lval_pool.frees[lval_gc.nursery[i].origin]++;
+    }
+  }
+  lval_gc.used = 0;
+  for (lval_slab *s = lval_pool.slabs; s; s = s->next) {
+    int n = s == lval_pool.slabs ? lval_pool.used : LVAL_SLAB_NODES;
+    for (int i = 0; i < n; i++) {
+      lval *v = &s->nodes[i];
+      if (v->flags & LVAL_MARKED) {
+        v->flags &= ~LVAL_MARKED;
+      } else if (!(v->flags & LVAL_FREED)) {
+        lval_release(v);
+        lval_free(v);
+        lval_gc.swept++;
+      }
+    }
+  }
+  lval_gc.pending = 0;
+  lval_gc.collections++;
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+  lval_gc.pause_total += pause;
+  if (pause > lval_gc.pause_max) {
+    lval_gc.pause_max = pause;
+  }
+}
+
+/* Size of buffer holding a formatted double */
+#define LVAL_DBL_DIGITS 32
+
+/* Bits kept of the powers of five and of their inverses */
+#define LVAL_POW5_BITS 125
+
+/* Powers of five the shortest digits of a double can need */
+#define LVAL_POW5_COUNT 326
+#define LVAL_POW5_INV_COUNT 292
+
+/* Power of two divided by the powers of five for their inverses, above
+   every power 2^j an inverse needs */
+#define LVAL_POW5_INV_SHIFT 1024
+
+/* Top LVAL_POW5_BITS bits of 5^i, and 2^j / 5^i rounded up for j that
+   many bits plus those of 5^i, as low and high halves. Filled in by
+   lval_dbl_init */
+uint64_t lval_pow5[LVAL_POW5_COUNT][2];
+uint64_t lval_pow5_inv[LVAL_POW5_INV_COUNT][2];
+
+/* Bits of 5^e, for e up to 3528 */
+int lval_pow5_bits(int e) {
+
+  return (int)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+/* Set w to the low 128 bits of b shifted right by s bits, or left when s
+   is negative */
+void lval_pow5_take(lbig *b, int s, uint64_t *w) {
+
+  w[0] = w[1] = 0;
+  for (int i = 0; i < 128; i++) {
+    int k = i + s;
+    if (k >= 0 && k < 32 * b->len && (b->d[k / 32] >> (k % 32) & 1)) {
+      w[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+  }
+}
+
+/* Compute the tables of powers of five used to print doubles. Inverses
+   come from one power of two divided by five again and again, as
+   flooring a floor is the floor of the whole quotient */
+void lval_dbl_init(void) {
+
+  lbig *five = lbig_from_long(5);
+  lbig *p = lbig_from_long(1);
+  for (int i = 0; i < LVAL_POW5_COUNT; i++) {
+    lval_pow5_take(p, lval_pow5_bits(i) - LVAL_POW5_BITS, lval_pow5[i]);
+    lbig *t = lbig_mul(p, five);
+    free(p);
+    p = t;
+  }
+  free(p);
+  free(five);
+
+  lbig *r = lbig_new(LVAL_POW5_INV_SHIFT / 32 + 1);
+  r->d[LVAL_POW5_INV_SHIFT / 32] = 1u << LVAL_POW5_INV_SHIFT % 32;
+  for (int i = 0; i < LVAL_POW5_INV_COUNT; i++) {
+    int j = lval_pow5_bits(i) - 1 + LVAL_POW5_BITS;
+    uint64_t *w = lval_pow5_inv[i];
+    lval_pow5_take(r, LVAL_POW5_INV_SHIFT - j, w);
+    w[1] += ++w[0] == 0;
+    lbig_div_small(r, 5);
+  }
+  free(r);
+}
+
+/* Bits j and up of m times the 128 bit multiplier mul, for j from 64 */
+uint64_t lval_mul_shift(uint64_t m, const uint64_t *mul, int j) {
+
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 lo = (unsigned __int128)m * mul[0];
+  unsigned __int128 hi = (unsigned __int128)m * mul[1];
+  return (uint64_t)(((lo >> 64) + hi) >> (j - 64));
+#else
+  /* the four 32 bit products of each half */
+  uint64_t m0 = (uint32_t)m;
+  uint64_t m1 = m >> 32;
+  uint64_t h[2];
+  uint64_t l[2];
+  for (int i = 0; i < 2; i++) {
+    uint64_t x0 = (uint32_t)mul[i];
+    uint64_t x1 = mul[i] >> 32;
+    uint64_t p01 = m0 * x1;
+    uint64_t p10 = m1 * x0;
+    uint64_t mid = (m0 * x0 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    h[i] = m1 * x1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    l[i] = mid << 32 | (uint32_t)(m0 * x0);
+  }
+  uint64_t lo = h[0] + l[1];
+  uint64_t hi = h[1] + (lo < h[0]);
+  int s = j - 64;
+  return s ? hi << (64 - s) | lo >> s : lo;
+#endif
+}
+
+/* Check whether 5^p divides non zero v */
+int lval_pow5_divides(uint64_t v, int p) {
+
+  int n = 0;
+  while (v % 5 == 0) {
+    v /= 5;
+    n++;
+  }
+  return n >= p;
+}
+
+/* Get the shortest decimal digits reading back to finite non zero x, the
+   nearest to x when there are several, as *digits times 10^*e. This is
+   Ryu (Ulf Adams, PLDI 2018): the bounds of the values rounding to x are
+   scaled by a power of ten, then digits are dropped while the bounds
+   still differ */
+void lval_dbl_shortest(double x, uint64_t *digits, int *e) {
+
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  uint64_t frac = bits & (((uint64_t)1 << 52) - 1);
+  int biased = (int)(bits >> 52 & 0x7ff);
+  uint64_t m = biased ? (uint64_t)1 << 52 | frac : frac;
+  int e2 = (biased ? biased : 1) - 1023 - 52 - 2;
+  int even = (m & 1) == 0;
+
+  /* x, its upper bound and its lower bound times 4, where the lower
+     gap is half as wide above a power of two */
+  uint64_t mv = 4 * m;
+  int shift = frac != 0 || biased <= 1;
+  uint64_t vr;
+  uint64_t vp;
+  uint64_t vm;
+  int e10;
+  int vm_zeros = 0;
+  int vr_zeros = 0;
+  if (e2 >= 0) {
+    int q = (int)(((uint32_t)e2 * 78913) >> 18) - (e2 > 3);
+    int j = -e2 + q + LVAL_POW5_BITS + lval_pow5_bits(q) - 1;
+    e10 = q;
+    vr = lval_mul_shift(mv, lval_pow5_inv[q], j);
+    vp = lval_mul_shift(mv + 2, lval_pow5_inv[q], j);
+    vm = lval_mul_shift(mv - 1 - shift, lval_pow5_inv[q], j);
+    /* only one of them can be a multiple of five */
+    if (q <= 21) {
+      if (mv % 5 == 0) {
+        vr_zeros = lval_pow5_divides(mv, q);
+      } else if (even) {
+        vm_zeros = lval_pow5_divides(mv - 1 - shift, q);
+      } else {
+        vp -= lval_pow5_divides(mv + 2, q);
+      }
+    }
+  } else {
+    int q = (int)(((uint32_t)-e2 * 732923) >> 20) - (-e2 > 1);
+    int i = -e2 - q;
+    int j = q - (lval_pow5_bits(i) - LVAL_POW5_BITS);
+    e10 = q + e2;
+    vr = lval_mul_shift(mv, lval_pow5[i], j);
+    vp = lval_mul_shift(mv + 2, lval_pow5[i], j);
+    vm = lval_mul_shift(mv - 1 - shift, lval_pow5[i], j);
+    if (q <= 1) {
+      vr_zeros = 1;
+      if (even) {
+        vm_zeros = shift;
+      } else {
+        vp--;
+      }
+    } else if (q < 63) {
+      vr_zeros = (mv & (((uint64_t)1 << q) - 1)) == 0;
+    }
+  }
+
+  /* drop digits while a shorter number lies between the bounds, then
+     round what is left by the last digit dropped */
+  int removed = 0;
+  int last = 0;
+  while (vp / 10 > vm / 10) {
+    vm_zeros &= vm % 10 == 0;
+    vr_zeros &= last == 0;
+    last = vr % 10;
+    vr /= 10;
+    vp /= 10;
+    vm /= 10;
+    removed++;
+  }
+  if (vm_zeros) {
+    while (vm % 10 == 0) {
+      vr_zeros &= last == 0;
+      last = vr % 10;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+  }
+  /* exactly halfway rounds to even */
+  if (vr_zeros && last == 5 && vr % 2 == 0) {
+    last = 4;
+  }
+  *digits = vr + ((vr == vm && (!even || !vm_zeros)) || last >= 5);
+  *e = e10 + removed;
+}
+
+/* Format double with the fewest digits that read back to the same value,
+   laid out like %.15g, or like %.16g and %.17g when it needs more digits.
+   Integral values get ".0" to stay doubles, and infinities and NaNs are
+   inf and nan, which read back too */
+void lval_dbl_format(double x, char *s) {
+
+  if (signbit(x)) {
+    *s++ = '-';
+  }
+  if (isnan(x) || isinf(x)) {
+    strcpy(s, isnan(x) ? "nan" : "inf");
+    return;
+  }
+  if (x == 0) {
+    strcpy(s, "0.0");
+    return;
+  }
+  uint64_t m;
+  int e;
+  lval_dbl_shortest(x, &m, &e);
+  while (m % 10 == 0) {
+    m /= 10;
+    e++;
+  }
+  char d[20];
+  int first = sizeof(d);
+  for (; m; m /= 10) {
+    d[--first] = '0' + m % 10;
+  }
+  int n = sizeof(d) - first;
+  char *digits = d + first;
+
+  /* exponent of the first digit, and precision %g would have used */
+  int exp = e + n - 1;
+  int p = n > 15 ? n : 15;
+  if (exp < -4 || exp >= p) {
+    *s++ = digits[0];
+    if (n > 1) {
+      *s++ = '.';
+      memcpy(s, digits + 1, n - 1);
+      s += n - 1;
+    }
+    *s++ = 'e';
+    *s++ = exp < 0 ? '-' : '+';
+    exp = exp < 0 ? -exp : exp;
+    if (exp >= 100) {
+      *s++ = '0' + exp / 100;
+    }
+    *s++ = '0' + exp / 10 % 10;
+    *s++ = '0' + exp % 10;
+  } else if (exp < 0) {
+    memcpy(s, "0.0000", 1 - exp);
+    memcpy(s + 1 - exp, digits, n);
+    s += 1 - exp + n;
+  } else if (n > exp + 1) {
+    memcpy(s, digits, exp + 1);
+    s[exp + 1] = '.';
+    memcpy(s + exp + 2, digits + exp + 1, n - exp - 1);
+    s += n + 1;
+  } else {
+    memcpy(s, digits, n);
+    memset(s + n, '0', exp + 1 - n);
+    s += exp + 1;
+    memcpy(s, ".0", 2);
+    s += 2;
+  }
+  *s = '\0';
+}
+
+/* Print vector like the Qexpr of numbers it stands for */
+void lval_vec_print(lval *v) {
+
+  char s[LVAL_DBL_DIGITS];
+  putchar('{');
+  for (int i = 0; i < v->count; i++) {
+    if (i) {
+      putchar(' ');
+    }
+    if (v->flags & LVAL_DOUBLES) {
+      lval_dbl_format(v->dbls[i], s);
+      fputs(s, stdout);
+    } else {
+      printf("%li", v->nums[i]);
+    }
+  }
+  putchar('}');
+}
+
+/* Print matrix as the expression building it */
+void lval_mat_print(lval *v) {
+
+  char s[LVAL_DBL_DIGITS];
+  fputs("(matrix {", stdout);
+  for (int i = 0; i < v->mat->rows; i++) {
+    fputs(i ? " {" : "{", stdout);
+    for (int j = 0; j < v->mat->cols; j++) {
+      if (j) {
+        putchar(' ');
+      }
+      lval_dbl_format(v->mat->d[i * v->mat->cols + j], s);
+      fputs(s, stdout);
+    }
+    putchar('}');
+  }
+  fputs("})", stdout);
+}
+
+/* Print lval that is no expression */
+void lval_print_atom(lval *v) {
+
+  switch (v->type) {
+  case LVAL_NUM:
+    printf("%li", v->num);
+    break;
+  case LVAL_BIG: {
+    char *s = lbig_to_str(v->big);
+    fputs(s, stdout);
+    free(s);
+    break;
+  }
+  case LVAL_DBL: {
+    char s[LVAL_DBL_DIGITS];
+    lval_dbl_format(v->dbl, s);
+    fputs(s, stdout);
+    break;
+  }
+  case LVAL_ERR:
+    printf("Error: %s", v->err);
+    break;
+  case LVAL_SYM:
+    printf("%s", v->sym);
+    break;
+  case LVAL_FUN:
+    printf("%s", lval_fun_names[v->op]);
+    break;
+  case LVAL_VEC:
+    lval_vec_print(v);
+    break;
+  case LVAL_MAT:
+    lval_mat_print(v);
+    break;
+  }
+}
+
+/* Print lval, keeping the expressions being printed on a work stack */
+void lval_print(lval *v) {
+
+  lval_stack s;
+  lval_stack_init(&s);
+  while (v) {
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      putchar(v->type == LVAL_SEXPR ? '(' : '{');
+      lval_stack_push(&s, v, 0);
+    } else {
+      lval_print_atom(v);
+    }
+
+    /* go on with the next element of the innermost expression, closing
+       the expressions that are done */
+    v = NULL;
+    while (s.count && !v) {
+      lval_frame *f = &s.frames[s.count - 1];
+      if (f->i < f->v->count) {
+        if (f->i) {
+          putchar(' ');
+        }
+        v = f->v->cell[f->i++];
+      } else {
+        putchar(f->v->type == LVAL_SEXPR ? ')' : '}');
+        s.count--;
+      }
+    }
+  }
+  lval_stack_release(&s);
+}
+
+void lval_println(lval *v) {
+
+  lval_print(v);
+  putchar('\n');
+}
+
+lval *lval_apply(lval *v);
+
+/* Evaluate lval. Sexprs whose children are being evaluated are kept on
+   a work stack, which the collector sees as roots */
+lval *lval_eval(lval *v) {
+
+  lval_stack s;
+  lval_stack_init(&s);
+  lval_gc_root_stack(&s);
+  for (;;) {
+    if (lval_gc.pending) {
+      lval_gc_root(&v);
+      lval_gc_collect();
+      lval_gc_unroot(1);
+    }
+    if (v->type == LVAL_SEXPR) {
+      lval_stack_push(&s, lval_own(v), 0);
+    } else if (s.count == 0) {
+      break;
+    } else {
+      lval_frame *f = &s.frames[s.count - 1];
+      f->v->cell[f->i++] = v;
+    }
+
+    /* apply the Sexprs whose children are all evaluated */
+    lval_frame *f = &s.frames[s.count - 1];
+    int tail = 0;
+    while (f->i == f->v->count) {
+      /* the Sexpr is consumed, so it stops being a root */
+      s.count--;
+      v = lval_apply(f->v);
+      if (v->flags & LVAL_TAIL) {
+        /* evaluate the Sexpr eval left in place of the call, on the same
+           work stack */
+        v->flags &= ~LVAL_TAIL;
+        tail = 1;
+        break;
+      }
+      if (s.count == 0) {
+        break;
+      }
+      f = &s.frames[s.count - 1];
+      f->v->cell[f->i++] = v;
+    }
+    if (tail) {
+      continue;
+    }
+    if (s.count == 0) {
+      break;
+    }
+    v = f->v->cell[f->i];
+  }
+  lval_gc_unroot_stack();
+  lval_stack_release(&s);
+  return v;
+}
+
+/* Get Qexpr with only the first element */
+lval *builtin_head(lval *a, int op) {
+
+  if (a->count != 1) {
+    lval_del(a);
+    return lval_err("Function 'head' passed too many arguments!");
+  }
+  if (a->cell[0]->type != LVAL_QEXPR && a->cell[0]->type != LVAL_VEC) {
+    lval_del(a);
+    return lval_err("Function 'head' passed incorrect types!");
+  }
+  if (a->cell[0]->count == 0) {
+    lval_del(a);
+    return lval_err("Function 'head' passed {}!");
+  }
+  lval* v = lval_take(a, 0);
+  v = lval_truncate(v, 1);
+  lval_compact(v);
+  return v;
+}
+
+/* Get Qexpr without the first element */
+lval* builtin_tail(lval* a, int op) {
+
+  if (a->count != 1) {
+    lval_del(a);
+    return lval_err("Function 'tail' passed too many arguments!");
+  }
+  if (a->cell[0]->type != LVAL_QEXPR && a->cell[0]->type != LVAL_VEC) {
+    lval_del(a);
+    return lval_err("Function 'tail' passed incorrect types!");
+  }
+  if (a->cell[0]->count == 0) {
+    lval_del(a);
+    return lval_err("Function 'tail' passed {}!");
+  }
+  lval* v = lval_own(lval_take(a, 0));
+  lval *x = lval_pop(v, 0);
+  if (v->type != LVAL_VEC) {
+    lval_del(x);
+  }
+  return v;
+}
+
+/* Get Qexpr from Sexpr */
+lval* builtin_list(lval* a, int op) {
+  a = lval_own(a);
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval* builtin_join(lval* a, int op) {
+
+  /* vectors stay packed when joined with vectors of the same kind */
+  int packed = 1;
+  int kind = -1;
+  for (int i = 0; i < a->count; i++) {
+    lval *x = a->cell[i];
+    if (x->type == LVAL_VEC) {
+      packed &= kind == -1 || kind == (x->flags & LVAL_DOUBLES);
+      kind = x->flags & LVAL_DOUBLES;
+    } else if (x->type == LVAL_QEXPR) {
+      packed &= x->count == 0;
+    } else {
+      lval_del(a);
+      return lval_err("Function 'join' passed incorrect types!");
+    }
+  }
+  for (int i = 0; i < a->count && !packed; i++) {
+    if (a->cell[i]->type == LVAL_VEC) {
+      a->cell[i] = lval_vec_expand(a->cell[i]);
+    }
+  }
+  lval* x = lval_pop(a, 0);
+  while (a->count) {
+    x = lval_join(x, lval_pop(a, 0));
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Operands builtin_op gathers on the stack for each kernel call */
+#define LVAL_OP_BLOCK 256
+
+/* Branchless minimum and maximum of two numbers */
+#define LVAL_MIN(a, b) ((b) ^ (((a) ^ (b)) & -(long)((a) < (b))))
+#define LVAL_MAX(a, b) ((b) ^ (((a) ^ (b)) & -(long)((a) > (b))))
+
+/* Define a kernel folding n contiguous operands y into *r with EXPR, which
+   sets of when the result no longer fits in a machine word */
+#define LVAL_OP_KERNEL(name, expr)        \
+  int name(long *r, long *y, int n) {     \
+    long x = *r;                          \
+    int of = 0;                           \
+    for (int i = 0; i < n; i++) {         \
+      expr;                               \
+    }                                     \
+    *r = x;                               \
+    return of;                            \
+  }
+
+LVAL_OP_KERNEL(lval_op_add, of |= __builtin_add_overflow(x, y[i], &x))
+LVAL_OP_KERNEL(lval_op_sub, of |= __builtin_sub_overflow(x, y[i], &x))
+LVAL_OP_KERNEL(lval_op_mul, of |= __builtin_mul_overflow(x, y[i], &x))
+LVAL_OP_KERNEL(lval_op_div,
+  of |= y[i] == -1 && x == LONG_MIN;
+  x = y[i] == -1 ? (long)(0UL - (unsigned long)x) : x / y[i])
+LVAL_OP_KERNEL(lval_op_mod, x = y[i] == -1 ? 0 : x % y[i])
+LVAL_OP_KERNEL(lval_op_min, x = LVAL_MIN(x, y[i]))
+LVAL_OP_KERNEL(lval_op_max, x = LVAL_MAX(x, y[i]))
+
+/* Raise x to the power e by squaring, storing it in r.
+   Returns non zero when the result is not a machine word integer */
+int lval_ipow(long x, long e, long *r) {
+
+  if (e < 0) {
+    /* only 1 and -1 have integer reciprocals, the rest truncate to 0 */
+    if (x == 0) {
+      return 1;
+    }
+    *r = x == 1 || x == -1 ? (e % 2 ? x : 1) : 0;
+    return 0;
+  }
+  long acc = 1;
+  while (e) {
+    if ((e & 1) && __builtin_mul_overflow(acc, x, &acc)) {
+      return 1;
+    }
+    e >>= 1;
+    if (e && __builtin_mul_overflow(x, x, &x)) {
+      return 1;
+    }
+  }
+  *r = acc;
+  return 0;
+}
+
+LVAL_OP_KERNEL(lval_op_pow, of |= lval_ipow(x, y[i], &x))
+
+/* Get x * y mod m for 0 <= x, y < m */
+long lval_mulmod(long x, long y, long m) {
+
+#ifdef __SIZEOF_INT128__
+  return (unsigned __int128)x * y % m;
+#else
+  /* double and add so intermediate values stay below 2m */
+  unsigned long r = 0;
+  unsigned long a = x;
+  for (unsigned long b = y; b; b >>= 1) {
+    if (b & 1) {
+      r = (r + a) % m;
+    }
+    a = (a * 2) % m;
+  }
+  return r;
+#endif
+}
+
+/* Check n contiguous operands for a zero divisor */
+int lval_op_has_zero(long *y, int n) {
+
+  int zero = 0;
+  for (int i = 0; i < n; i++) {
+    zero |= y[i] == 0;
+  }
+  return zero;
+}
+
+/* Fold n machine word operands into *x with the kernel of op.
+   Returns non zero on overflow, leaving *x unchanged */
+int lval_op_kernel(int op, long *x, long *y, int n) {
+
+  long r = *x;
+  int of = 0;
+  switch (op) {
+    case LFUN_ADD: of = lval_op_add(&r, y, n); break;
+    case LFUN_SUB: of = lval_op_sub(&r, y, n); break;
+    case LFUN_MUL: of = lval_op_mul(&r, y, n); break;
+    /* zero stays zero, only the divisors still need checking */
+    case LFUN_DIV: of = r ? lval_op_div(&r, y, n) : 0; break;
+    case LFUN_MOD: of = r ? lval_op_mod(&r, y, n) : 0; break;
+    case LFUN_POW: of = lval_op_pow(&r, y, n); break;
+    case LFUN_MIN: of = lval_op_min(&r, y, n); break;
+    case LFUN_MAX: of = lval_op_max(&r, y, n); break;
+  }
+  if (!of) {
+    *x = r;
+  }
+  return of;
+}
+
+/* Fold the n > 0 elements of an int vector with op into *r.
+   Returns non zero on overflow */
+int lval_vec_fold_nums(int op, long *x, int n, long *r) {
+
+  *r = x[0];
+  return lval_op_kernel(op, r, x + 1, n - 1);
+}
+
+/* Fold n doubles into r with op */
+double lval_dbl_fold(int op, double r, double *x, int n) {
+
+  switch (op) {
+    case LFUN_ADD:
+      for (int i = 0; i < n; i++) {
+        r += x[i];
+      }
+      break;
+    case LFUN_MUL:
+      for (int i = 0; i < n; i++) {
+        r *= x[i];
+      }
+      break;
+    case LFUN_MIN:
+      for (int i = 0; i < n; i++) {
+        r = x[i] < r ? x[i] : r;
+      }
+      break;
+    case LFUN_MAX:
+      for (int i = 0; i < n; i++) {
+        r = x[i] > r ? x[i] : r;
+      }
+      break;
+  }
+  return r;
+}
+
+/* Fold the n > 0 elements of a double vector with op */
+double lval_vec_fold_dbls(int op, double *x, int n) {
+
+  return lval_dbl_fold(op, x[0], x + 1, n - 1);
+}
+
+/* Apply op element-wise to n ints of x and y into r. x and y advance by
+   xs and ys elements, a step of 0 broadcasts a scalar.
+   Returns non zero on overflow */
+int lval_vec_map_nums(int op, long *r, long *x, int xs, long *y, int ys,
+  int n) {
+
+  int of = 0;
+  for (int i = 0; i < n; i++) {
+    long a = x[i * xs];
+    long b = y[i * ys];
+    switch (op) {
+      case LFUN_ADD: of |= __builtin_add_overflow(a, b, &r[i]); break;
+      case LFUN_SUB: of |= __builtin_sub_overflow(a, b, &r[i]); break;
+      case LFUN_MUL: of |= __builtin_mul_overflow(a, b, &r[i]); break;
+      case LFUN_DIV:
+        of |= b == -1 && a == LONG_MIN;
+        r[i] = b == -1 ? (long)(0UL - (unsigned long)a) : a / b;
+        break;
+      case LFUN_MOD: r[i] = b == -1 ? 0 : a % b; break;
+      case LFUN_POW: of |= lval_ipow(a, b, &r[i]); break;
+      case LFUN_MIN: r[i] = LVAL_MIN(a, b); break;
+      case LFUN_MAX: r[i] = LVAL_MAX(a, b); break;
+    }
+  }
+  return of;
+}
+
+/* Apply op element-wise to n doubles of x and y into r, stepping like
+   lval_vec_map_nums */
+void lval_vec_map_dbls(int op, double *r, double *x, int xs, double *y,
+  int ys, int n) {
+
+  for (int i = 0; i < n; i++) {
+    double a = x[i * xs];
+    double b = y[i * ys];
+    switch (op) {
+      case LFUN_ADD: r[i] = a + b; break;
+      case LFUN_SUB: r[i] = a - b; break;
+      case LFUN_MUL: r[i] = a * b; break;
+      case LFUN_DIV: r[i] = a / b; break;
+      case LFUN_MOD: r[i] = fmod(a, b); break;
+      case LFUN_POW: r[i] = pow(a, b); break;
+      case LFUN_MIN: r[i] = a < b ? a : b; break;
+      case LFUN_MAX: r[i] = a > b ? a : b; break;
+    }
+  }
+}
+
+/* Add the product of a (n by m) and b (m by p) to c (n by p). The inner
+   loop runs along rows of b and c, which the AVX2 kernel vectorizes */
+void lmat_mul_add(double *c, double *a, double *b, int n, int m, int p) {
+
+  for (int kk = 0; kk < m; kk += LMAT_BLOCK_K) {
+    int ke = kk + LMAT_BLOCK_K < m ? kk + LMAT_BLOCK_K : m;
+    for (int jj = 0; jj < p; jj += LMAT_BLOCK_J) {
+      int je = jj + LMAT_BLOCK_J < p ? jj + LMAT_BLOCK_J : p;
+      for (int i = 0; i < n; i++) {
+        double *ci = c + (size_t)i * p;
+        for (int k = kk; k < ke; k++) {
+          double x = a[(size_t)i * m + k];
+          double *bk = b + (size_t)k * p;
+          for (int j = jj; j < je; j++) {
+            ci[j] += x * bk[j];
+          }
+        }
+      }
+    }
+  }
+}
+
+#ifdef LVAL_AVX2
+
+/* Fold four lanes of int elements at a time. Lanes overflow on their own,
+   which is reported as overflow of the whole fold. Products use the
+   scalar kernel, AVX2 has no 64 bit multiply */
+__attribute__((target("avx2")))
+int lval_vec_fold_nums_avx2(int op, long *x, int n, long *r) {
+
+  if (n < 8 || op == LFUN_MUL) {
+    return lval_vec_fold_nums(op, x, n, r);
+  }
+  __m256i acc = _mm256_loadu_si256((__m256i *)x);
+  __m256i of = _mm256_setzero_si256();
+  int i = 4;
+  switch (op) {
+    case LFUN_ADD:
+      for (; i + 4 <= n; i += 4) {
+        __m256i y = _mm256_loadu_si256((__m256i *)(x + i));
+        __m256i s = _mm256_add_epi64(acc, y);
+        /* the sum overflowed when its sign differs from both operands */
+        of = _mm256_or_si256(of, _mm256_and_si256(_mm256_xor_si256(acc, s),
+          _mm256_xor_si256(y, s)));
+        acc = s;
+      }
+      break;
+    case LFUN_MIN:
+      for (; i + 4 <= n; i += 4) {
+        __m256i y = _mm256_loadu_si256((__m256i *)(x + i));
+        acc = _mm256_blendv_epi8(acc, y, _mm256_cmpgt_epi64(acc, y));
+      }
+      break;
+    case LFUN_MAX:
+      for (; i + 4 <= n; i += 4) {
+        __m256i y = _mm256_loadu_si256((__m256i *)(x + i));
+        acc = _mm256_blendv_epi8(acc, y, _mm256_cmpgt_epi64(y, acc));
+      }
+      break;
+  }
+  if (_mm256_movemask_pd(_mm256_castsi256_pd(of))) {
+    return 1;
+  }
+  long lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  *r = lanes[0];
+  return lval_op_kernel(op, r, lanes + 1, 3) ||
+    lval_op_kernel(op, r, x + i, n - i);
+}
+
+/* Apply F to two accumulators of four double lanes, then merge them.
+   The accumulators go second, which min and max give back when either
+   lane is NaN, like the scalar fold keeps its running value */
+#define LVAL_AVX2_FOLD(f)                           \
+  for (; i + 8 <= n; i += 8) {                      \
+    a = f(_mm256_loadu_pd(x + i), a);               \
+    b = f(_mm256_loadu_pd(x + i + 4), b);           \
+  }                                                 \
+  a = f(b, a)
+
+/* Fold eight double elements at a time. The lanes are combined at the
+   end, so sums and products may round differently from a left fold.
+   Min and max start every lane from the first element, so a NaN is kept
+   only when it comes first, as in lval_dbl_fold */
+__attribute__((target("avx2")))
+double lval_vec_fold_dbls_avx2(int op, double *x, int n) {
+
+  if (n < 8) {
+    return lval_vec_fold_dbls(op, x, n);
+  }
+  __m256d a = _mm256_loadu_pd(x);
+  __m256d b = _mm256_loadu_pd(x + 4);
+  int i = 8;
+  if (op == LFUN_MIN || op == LFUN_MAX) {
+    a = b = _mm256_set1_pd(x[0]);
+    i = 0;
+  }
+  switch (op) {
+    case LFUN_ADD: LVAL_AVX2_FOLD(_mm256_add_pd); break;
+    case LFUN_MUL: LVAL_AVX2_FOLD(_mm256_mul_pd); break;
+    case LFUN_MIN: LVAL_AVX2_FOLD(_mm256_min_pd); break;
+    case LFUN_MAX: LVAL_AVX2_FOLD(_mm256_max_pd); break;
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, a);
+  return lval_dbl_fold(op, lval_vec_fold_dbls(op, lanes, 4), x + i, n - i);
+}
+
+/* Store F of four lanes of x and y into r, scalars are broadcast to
+   xc and yc. OF accumulates the lanes that overflowed */
+#define LVAL_AVX2_MAP_NUMS(f, of_)                                      \
+  for (; i + 4 <= n; i += 4) {                                          \
+    __m256i a = xs ? _mm256_loadu_si256((__m256i *)(x + i)) : xc;       \
+    __m256i b = ys ? _mm256_loadu_si256((__m256i *)(y + i)) : yc;       \
+    __m256i s = f;                                                      \
+    of = _mm256_or_si256(of, of_);                                      \
+    _mm256_storeu_si256((__m256i *)(r + i), s);                         \
+  }
+
+/* Map four ints at a time, the other ops use the scalar kernel */
+__attribute__((target("avx2")))
+int lval_vec_map_nums_avx2(int op, long *r, long *x, int xs, long *y,
+  int ys, int n) {
+
+  __m256i xc = _mm256_set1_epi64x(*x);
+  __m256i yc = _mm256_set1_epi64x(*y);
+  __m256i of = _mm256_setzero_si256();
+  __m256i no = _mm256_setzero_si256();
+  int i = 0;
+  switch (op) {
+    case LFUN_ADD:
+      LVAL_AVX2_MAP_NUMS(_mm256_add_epi64(a, b), _mm256_and_si256(
+        _mm256_xor_si256(a, s), _mm256_xor_si256(b, s)));
+      break;
+    case LFUN_SUB:
+      /* a - b overflowed when a and b differ in sign and s differs from a */
+      LVAL_AVX2_MAP_NUMS(_mm256_sub_epi64(a, b), _mm256_and_si256(
+        _mm256_xor_si256(a, b), _mm256_xor_si256(a, s)));
+      break;
+    case LFUN_MIN:
+      LVAL_AVX2_MAP_NUMS(_mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b)), no);
+      break;
+    case LFUN_MAX:
+      LVAL_AVX2_MAP_NUMS(_mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(b, a)), no);
+      break;
+  }
+  if (_mm256_movemask_pd(_mm256_castsi256_pd(of))) {
+    return 1;
+  }
+  return lval_vec_map_nums(op, r + i, x + i * xs, xs, y + i * ys, ys, n - i);
+}
+
+/* Store F of four double lanes of x and y into r */
+#define LVAL_AVX2_MAP_DBLS(f)                                           \
+  for (; i + 4 <= n; i += 4) {                                          \
+    __m256d a = xs ? _mm256_loadu_pd(x + i) : xc;                       \
+    __m256d b = ys ? _mm256_loadu_pd(y + i) : yc;                       \
+    _mm256_storeu_pd(r + i, f(a, b));                                   \
+  }
+
+/* Map four doubles at a time, % and ^ use the scalar kernel */
+__attribute__((target("avx2")))
+void lval_vec_map_dbls_avx2(int op, double *r, double *x, int xs, double *y,
+  int ys, int n) {
+
+  __m256d xc = _mm256_set1_pd(*x);
+  __m256d yc = _mm256_set1_pd(*y);
+  int i = 0;
+  switch (op) {
+    case LFUN_ADD: LVAL_AVX2_MAP_DBLS(_mm256_add_pd); break;
+    case LFUN_SUB: LVAL_AVX2_MAP_DBLS(_mm256_sub_pd); break;
+    case LFUN_MUL: LVAL_AVX2_MAP_DBLS(_mm256_mul_pd); break;
+    case LFUN_DIV: LVAL_AVX2_MAP_DBLS(_mm256_div_pd); break;
+    /* min_pd and max_pd pick b on ties and NaN, like the scalar kernel */
+    case LFUN_MIN: LVAL_AVX2_MAP_DBLS(_mm256_min_pd); break;
+    case LFUN_MAX: LVAL_AVX2_MAP_DBLS(_mm256_max_pd); break;
+  }
+  lval_vec_map_dbls(op, r + i, x + i * xs, xs, y + i * ys, ys, n - i);
+}
+
+/* Blocked like lmat_mul_add, with eight columns of c per step kept in
+   registers across two rows of b */
+__attribute__((target("avx2,fma")))
+void lmat_mul_add_avx2(double *c, double *a, double *b, int n, int m,
+  int p) {
+
+  for (int kk = 0; kk < m; kk += LMAT_BLOCK_K) {
+    int ke = kk + LMAT_BLOCK_K < m ? kk + LMAT_BLOCK_K : m;
+    for (int jj = 0; jj < p; jj += LMAT_BLOCK_J) {
+      int je = jj + LMAT_BLOCK_J < p ? jj + LMAT_BLOCK_J : p;
+      for (int i = 0; i < n; i++) {
+        double *ci = c + (size_t)i * p;
+        double *ai = a + (size_t)i * m;
+        int k = kk;
+        for (; k + 2 <= ke; k += 2) {
+          __m256d x0 = _mm256_set1_pd(ai[k]);
+          __m256d x1 = _mm256_set1_pd(ai[k + 1]);
+          double *b0 = b + (size_t)k * p;
+          double *b1 = b0 + p;
+          int j = jj;
+          for (; j + 8 <= je; j += 8) {
+            __m256d c0 = _mm256_loadu_pd(ci + j);
+            __m256d c1 = _mm256_loadu_pd(ci + j + 4);
+            c0 = _mm256_fmadd_pd(x0, _mm256_loadu_pd(b0 + j), c0);
+            c1 = _mm256_fmadd_pd(x0, _mm256_loadu_pd(b0 + j + 4), c1);
+            c0 = _mm256_fmadd_pd(x1, _mm256_loadu_pd(b1 + j), c0);
+            c1 = _mm256_fmadd_pd(x1, _mm256_loadu_pd(b1 + j + 4), c1);
+            _mm256_storeu_pd(ci + j, c0);
+            _mm256_storeu_pd(ci + j + 4, c1);
+          }
+          for (; j < je; j++) {
+            ci[j] += ai[k] * b0[j] + ai[k + 1] * b1[j];
+          }
+        }
+        for (; k < ke; k++) {
+          __m256d x0 = _mm256_set1_pd(ai[k]);
+          double *b0 = b + (size_t)k * p;
+          int j = jj;
+          for (; j + 4 <= je; j += 4) {
+            __m256d c0 = _mm256_loadu_pd(ci + j);
+            c0 = _mm256_fmadd_pd(x0, _mm256_loadu_pd(b0 + j), c0);
+            _mm256_storeu_pd(ci + j, c0);
+          }
+          for (; j < je; j++) {
+            ci[j] += ai[k] * b0[j];
+          }
+        }
+      }
+    }
+  }
+}
+
+#endif
+
+/* Kernels of vectors and matrices, the scalar ones unless the cpu has
+   better */
+struct {
+  int (*fold_nums)(int op, long *x, int n, long *r);
+  double (*fold_dbls)(int op, double *x, int n);
+  int (*map_nums)(int op, long *r, long *x, int xs, long *y, int ys, int n);
+  void (*map_dbls)(int op, double *r, double *x, int xs, double *y, int ys,
+    int n);
+  void (*mat_mul)(double *c, double *a, double *b, int n, int m, int p);
+} lval_vec_kernels = {
+  lval_vec_fold_nums, lval_vec_fold_dbls, lval_vec_map_nums, lval_vec_map_dbls,
+  lmat_mul_add
+};
+
+/* Pick the vector kernels and the tokenizer for the cpu */
+void lval_vec_init(void) {
+
+#ifdef LVAL_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    lval_vec_kernels.fold_nums = lval_vec_fold_nums_avx2;
+    lval_vec_kernels.fold_dbls = lval_vec_fold_dbls_avx2;
+    lval_vec_kernels.map_nums = lval_vec_map_nums_avx2;
+    lval_vec_kernels.map_dbls = lval_vec_map_dbls_avx2;
+    lval_scan_tokens = lval_scan_index_avx2;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    lval_vec_kernels.mat_mul = lmat_mul_add_avx2;
+  }
+#endif
+}
+
+/* Get a new bignum holding the value of a Number lval */
+lbig *lval_to_big(lval *v) {
+
+  return v->type == LVAL_BIG ? lbig_copy(v->big) : lbig_from_long(v->num);
+}
+
+/* Apply op to bignum x and operand y, returning an error message on failure */
+char *lval_big_op(lval *x, lval *y, int op) {
+
+  lbig *b = lval_to_big(y);
+  lbig *r = NULL;
+  char *err = NULL;
+  switch (op) {
+    case LFUN_ADD: r = lbig_add(x->big, b); break;
+    case LFUN_SUB: r = lbig_sub(x->big, b); break;
+    case LFUN_MUL: r = lbig_mul(x->big, b); break;
+    case LFUN_DIV:
+    case LFUN_MOD:
+      if (!b->len) {
+        err = "Division By Zero!";
+      } else {
+        lbig *q;
+        lbig *m;
+        lbig_divmod(x->big, b, &q, &m);
+        r = op == LFUN_DIV ? q : m;
+        free(op == LFUN_DIV ? m : q);
+      }
+      break;
+    case LFUN_POW:
+      if (b->neg) {
+        /* truncate like lval_ipow does */
+        if (!x->big->len) {
+          err = "Division By Zero!";
+        } else if (x->big->len == 1 && x->big->d[0] == 1) {
+          r = lbig_from_long(x->big->neg && (b->d[0] & 1) ? -1 : 1);
+        } else {
+          r = lbig_new(0);
+        }
+      } else if (!b->len) {
+        r = lbig_from_long(1);
+      } else if (x->big->len == 0 ||
+        (x->big->len == 1 && x->big->d[0] == 1)) {
+        r = lbig_from_long(x->big->neg && (b->d[0] & 1) ? -1 : x->big->len);
+      } else if (b->len > 1 || lbig_bits(x->big) * b->d[0] > LBIG_MAX_BITS) {
+        err = "Exponent too large!";
+      } else {
+        r = lbig_pow(x->big, b->len ? b->d[0] : 0);
+      }
+      break;
+    case LFUN_MIN:
+      if (lbig_cmp(b, x->big) < 0) {
+        r = b;
+        b = NULL;
+      }
+      break;
+    case LFUN_MAX:
+      if (lbig_cmp(b, x->big) > 0) {
+        r = b;
+        b = NULL;
+      }
+      break;
+  }
+  if (r) {
+    free(x->big);
+    x->big = r;
+  }
+  free(b);
+  return err;
+}
+
+/* Get value of a Number lval as a double */
+double lval_to_dbl(lval *v) {
+
+  switch (v->type) {
+    case LVAL_NUM: return (double)v->num;
+    case LVAL_BIG: return lbig_to_double(v->big);
+    default: return v->dbl;
+  }
+}
+
+/* Apply op to x and operand y as doubles, returning an error message on
+   failure. x is promoted to a double first */
+char *lval_dbl_op(lval *x, lval *y, int op) {
+
+  double r = lval_to_dbl(x);
+  double b = lval_to_dbl(y);
+  if ((op == LFUN_DIV || op == LFUN_MOD) && b == 0) {
+    return "Division By Zero!";
+  }
+  switch (op) {
+    case LFUN_ADD: r += b; break;
+    case LFUN_SUB: r -= b; break;
+    case LFUN_MUL: r *= b; break;
+    case LFUN_DIV: r /= b; break;
+    case LFUN_MOD: r = fmod(r, b); break;
+    case LFUN_POW: r = pow(r, b); break;
+    case LFUN_MIN: r = b < r ? b : r; break;
+    case LFUN_MAX: r = b > r ? b : r; break;
+  }
+  if (x->type == LVAL_BIG) {
+    free(x->big);
+  }
+  x->type = LVAL_DBL;
+  x->dbl = r;
+  return NULL;
+}
+
+lval *builtin_op(lval *a, int op);
+lval *lval_op_fold(lval *a, int op);
+
+/* Reduce the elements of a non empty vector with op */
+lval *lval_vec_reduce(lval *v, int op) {
+
+  lval *x = NULL;
+  long r;
+  if (v->flags & LVAL_DOUBLES) {
+    x = lval_dbl(lval_vec_kernels.fold_dbls(op, v->dbls, v->count));
+  } else if (!lval_vec_kernels.fold_nums(op, v->nums, v->count, &r)) {
+    x = lval_num(r);
+  }
+  if (x) {
+    lval_del(v);
+    return x;
+  }
+  /* redo an overflowing reduction with bignums */
+  v = lval_vec_expand(v);
+  v->type = LVAL_SEXPR;
+  return builtin_op(v, op);
+}
+
+/* Get element count of a list operand, -1 for a scalar */
+int lval_list_len(lval *v) {
+
+  return v->type == LVAL_VEC || v->type == LVAL_QEXPR ? v->count : -1;
+}
+
+/* Turn an int vector into a vector of doubles, in place */
+lval *lval_vec_to_dbls(lval *v) {
+
+  if (v->type != LVAL_VEC || v->flags & LVAL_DOUBLES) {
+    return v;
+  }
+  v = lval_own(v);
+  for (int i = 0; i < v->count; i++) {
+    v->dbls[i] = (double)v->nums[i];
+  }
+  v->flags |= LVAL_DOUBLES;
+  return v;
+}
+
+/* Create a vector of n uninitialised elements */
+lval *lval_vec(int n, int dbl) {
+
+  lval *v = lval_alloc(LVAL_VEC);
+  v->count = 0;
+  v->cell = NULL;
+  lval_reserve(v, n);
+  v->count = n;
+  if (dbl) {
+    v->flags |= LVAL_DOUBLES;
+  }
+  return v;
+}
+
+/* Apply op element-wise to n unboxed elements of x and y, each a vector
+   or a scalar, into a new vector. Doubles must already be vectors of
+   doubles. Returns NULL when an int element overflows */
+lval *lval_vec_map(lval *x, lval *y, int op, int n) {
+
+  int xs = x->type == LVAL_VEC;
+  int ys = y->type == LVAL_VEC;
+  int dbl = x->type == LVAL_DBL || y->type == LVAL_DBL
+    || (x->flags | y->flags) & LVAL_DOUBLES;
+  int div = op == LFUN_DIV || op == LFUN_MOD;
+  if (dbl) {
+    double xc = xs ? 0 : lval_to_dbl(x);
+    double yc = ys ? 0 : lval_to_dbl(y);
+    double *yp = ys ? y->dbls : &yc;
+    for (int i = 0; div && i < (ys ? n : 1); i++) {
+      if (yp[i] == 0) {
+        return lval_err("Division By Zero!");
+      }
+    }
+    lval *r = lval_vec(n, 1);
+    lval_vec_kernels.map_dbls(op, r->dbls, xs ? x->dbls : &xc, xs, yp, ys, n);
+    return r;
+  }
+  long *yp = ys ? y->nums : &y->num;
+  if (div && lval_op_has_zero(yp, ys ? n : 1)) {
+    return lval_err("Division By Zero!");
+  }
+  lval *r = lval_vec(n, 0);
+  if (lval_vec_kernels.map_nums(op, r->nums, xs ? x->nums : &x->num, xs, yp,
+    ys, n)) {
+    lval_del(r);
+    return NULL;
+  }
+  return r;
+}
+
+/* Check whether v can be broadcast over or with: a list or a number */
+int lval_broadcasts(lval *v) {
+
+  return lval_list_len(v) >= 0 || v->type == LVAL_NUM || v->type == LVAL_BIG
+    || v->type == LVAL_DBL;
+}
+
+/* Apply op element-wise between x and y when the kernels can, or when
+   there are no lists to pair up, taking ownership of both. Otherwise get
+   NULL, leaving x and y as Qexprs or scalars to be paired up element by
+   element */
+lval *lval_broadcast_flat(lval **px, lval **py, int op) {
+
+  lval *x = *px;
+  lval *y = *py;
+  int xn = lval_list_len(x);
+  int yn = lval_list_len(y);
+  /* builtin_op reports anything that cannot be broadcast */
+  if ((xn < 0 && yn < 0) || !lval_broadcasts(x) || !lval_broadcasts(y)) {
+    return builtin_op(lval_add(lval_add(lval_sexpr(), x), y), op);
+  }
+  if (xn >= 0 && yn >= 0 && xn != yn) {
+    lval_del(x);
+    lval_del(y);
+    return lval_err("Cannot broadcast lists of different lengths!");
+  }
+  int n = xn >= 0 ? xn : yn;
+  int xt = x->type;
+  int yt = y->type;
+  if (n && (xt == LVAL_VEC || xt == LVAL_NUM || xt == LVAL_DBL)
+    && (yt == LVAL_VEC || yt == LVAL_NUM || yt == LVAL_DBL)) {
+    /* mixing ints with doubles makes doubles of both */
+    if (xt == LVAL_DBL || yt == LVAL_DBL || (x->flags | y->flags) & LVAL_DOUBLES) {
+      x = lval_vec_to_dbls(x);
+      y = lval_vec_to_dbls(y);
+    }
+    lval *r = lval_vec_map(x, y, op, n);
+    if (r) {
+      lval_del(x);
+      lval_del(y);
+      return r;
+    }
+  }
+  *px = x->type == LVAL_VEC ? lval_vec_expand(x) : x;
+  *py = y->type == LVAL_VEC ? lval_vec_expand(y) : y;
+  return NULL;
+}
+
+/* Apply op element-wise between x and y, broadcasting a scalar over the
+   elements of a list. Lists must have the same length. Lists of lists
+   are paired up on a work stack rather than by recursion, with three
+   frames for each pair of lists: the two operands, then the results so
+   far with the index of the next pair of elements */
+lval *lval_broadcast(lval *x, lval *y, int op) {
+
+  lval *r = lval_broadcast_flat(&x, &y, op);
+  if (r) {
+    return r;
+  }
+  lval_stack s;
+  lval_stack_init(&s);
+  for (;;) {
+    if (!r) {
+      lval *q = lval_qexpr();
+      lval_reserve(q, (x->type == LVAL_QEXPR ? x : y)->count);
+      lval_stack_push(&s, x, 0);
+      lval_stack_push(&s, y, 0);
+      lval_stack_push(&s, q, 0);
+    }
+
+    /* add r to the results of the innermost pair of lists, and take its
+       next pair of elements, finishing the pairs of lists done */
+    while (s.count) {
+      lval_frame *f = &s.frames[s.count - 1];
+      lval *fx = f[-2].v;
+      lval *fy = f[-1].v;
+      if (r && r->type != LVAL_ERR) {
+        f->v = lval_add(f->v, r);
+        r = NULL;
+      }
+      int xl = fx->type == LVAL_QEXPR;
+      int yl = fy->type == LVAL_QEXPR;
+      if (!r && f->i < (xl ? fx : fy)->count) {
+        x = lval_copy(xl ? fx->cell[f->i] : fx);
+        y = lval_copy(yl ? fy->cell[f->i] : fy);
+        f->i++;
+        break;
+      }
+      /* an error replaces the results */
+      if (r) {
+        lval_del(f->v);
+      } else {
+        r = lval_vec_pack(f->v);
+      }
+      lval_del(fx);
+      lval_del(fy);
+      s.count -= 3;
+    }
+    if (r) {
+      break;
+    }
+    r = lval_broadcast_flat(&x, &y, op);
+  }
+  lval_stack_release(&s);
+  return r;
+}
+
+/* Apply op element-wise between matrices of the same shape, or between
+   a matrix and a scalar */
+lval *lval_mat_op(lval *x, lval *y, int op) {
+
+  int xs = x->type == LVAL_MAT;
+  int ys = y->type == LVAL_MAT;
+  char *err = NULL;
+  if (!xs && !ys) {
+    return builtin_op(lval_add(lval_add(lval_sexpr(), x), y), op);
+  }
+  if (lval_list_len(x) >= 0 || lval_list_len(y) >= 0) {
+    err = "Cannot operate on matrix and list!";
+  } else if (xs && ys && (x->mat->rows != y->mat->rows
+    || x->mat->cols != y->mat->cols)) {
+    err = "Cannot operate on matrices of different shapes!";
+  }
+  lmat *m = xs ? x->mat : y->mat;
+  int n = m->rows * m->cols;
+  double xc = xs ? 0 : lval_to_dbl(x);
+  double yc = ys ? 0 : lval_to_dbl(y);
+  double *yp = ys ? y->mat->d : &yc;
+  for (int i = 0; !err && (op == LFUN_DIV || op == LFUN_MOD)
+    && i < (ys ? n : 1); i++) {
+    if (yp[i] == 0) {
+      err = "Division By Zero!";
+    }
+  }
+  if (err) {
+    lval_del(x);
+    lval_del(y);
+    return lval_err(err);
+  }
+  /* an unshared left matrix takes the result in place */
+  lval *r = xs && x->refs == 1 ? x : lval_mat(lmat_new(m->rows, m->cols));
+  lval_vec_kernels.map_dbls(op, r->mat->d, xs ? x->mat->d : &xc, xs, yp, ys,
+    n);
+  if (r != x) {
+    lval_del(x);
+  }
+  lval_del(y);
+  return r;
+}
+
+/* Handle operations */
+lval *builtin_op(lval *a, int op) {
+
+  if (op == LFUN_SUM) {
+    op = LFUN_ADD;
+  }
+  /* a single list or matrix argument is reduced over its elements */
+  int t = a->cell[0]->type;
+  if (a->count == 1 && (t == LVAL_VEC || t == LVAL_QEXPR || t == LVAL_MAT)
+    && (op == LFUN_ADD || op == LFUN_MUL || op == LFUN_MIN || op == LFUN_MAX)) {
+    lval *v = lval_take(a, 0);
+    if (t == LVAL_MAT) {
+      lval *x = lval_dbl(lval_vec_kernels.fold_dbls(op, v->mat->d,
+        v->mat->rows * v->mat->cols));
+      lval_del(v);
+      return x;
+    }
+    if (v->count == 0) {
+      lval_del(v);
+      return lval_err("Cannot reduce {}!");
+    }
+    if (t == LVAL_VEC) {
+      return lval_vec_reduce(v, op);
+    }
+    a = lval_own(v);
+    a->type = LVAL_SEXPR;
+  }
+
+  int lists = 0;
+  int mats = 0;
+  for (int i = 0; i < a->count; i++) {
+    int t = a->cell[i]->type;
+    int list = t == LVAL_VEC || t == LVAL_QEXPR;
+    lists |= list;
+    mats |= t == LVAL_MAT;
+    if (t != LVAL_NUM && t != LVAL_BIG && t != LVAL_DBL && t != LVAL_MAT
+      && !list) {
+      lval_del(a);
+      return lval_err("Cannot operate on non-number!");
+    }
+  }
+
+  /* lists and matrices are operated on element by element */
+  if (lists || mats) {
+    lval *(*apply)(lval *, lval *, int) = mats ? lval_mat_op : lval_broadcast;
+    lval *x = lval_pop(a, 0);
+    if (op == LFUN_SUB && a->count == 0) {
+      x = apply(x, lval_num(-1), LFUN_MUL);
+    }
+    while (a->count && x->type != LVAL_ERR) {
+      x = apply(x, lval_pop(a, 0), op);
+    }
+    lval_del(a);
+    return x;
+  }
+
+  return lval_op_fold(a, op);
+}
+
+/* Fold op over numbers, bignums and doubles a holds, with the first as
+   the starting value. Taking a's first value when there is no other is
+   unary negation for - */
+lval *lval_op_fold(lval *a, int op) {
+
+  lval *x = lval_own(lval_pop(a, 0));
+
+  /* unary negation */
+  if (op == LFUN_SUB && a->count == 0) {
+    if (x->type == LVAL_DBL) {
+      x->dbl = -x->dbl;
+    } else if (x->type == LVAL_NUM && x->num != LONG_MIN) {
+      x->num = -x->num;
+    } else {
+      lval_big_promote(x);
+      x->big->neg = x->big->len && !x->big->neg;
+    }
+  }
+
+  /* machine word operands are folded by the kernels in contiguous blocks,
+     the rest of the work continues on bignums once a value needs one.
+     Like in C a double operand turns the value into a double from there on */
+  long y[LVAL_OP_BLOCK];
+  char *err = NULL;
+  int i = 0;
+  while (i < a->count && !err) {
+    int n = 0;
+    while (x->type == LVAL_NUM && n < LVAL_OP_BLOCK && i + n < a->count
+      && a->cell[i + n]->type == LVAL_NUM) {
+      y[n] = a->cell[i + n]->num;
+      n++;
+    }
+    if ((op == LFUN_DIV || op == LFUN_MOD) && lval_op_has_zero(y, n)) {
+      err = "Division By Zero!";
+      break;
+    }
+    if (!n && (x->type == LVAL_DBL || a->cell[i]->type == LVAL_DBL)) {
+      err = lval_dbl_op(x, a->cell[i], op);
+      i++;
+      continue;
+    }
+    if (n && !lval_op_kernel(op, &x->num, y, n)) {
+      i += n;
+      continue;
+    }
+    /* redo an overflowing block with bignums */
+    lval_big_promote(x);
+    int end = n ? i + n : i + 1;
+    for (; i < end && !err; i++) {
+      err = lval_big_op(x, a->cell[i], op);
+    }
+  }
+
+  lval_del(a);
+  if (err) {
+    lval_del(x);
+    return lval_err(err);
+  }
+  lval_big_demote(x);
+  return x;
+}
+
+/* Raise bignum base to exp modulo mod */
+lval *lval_powmod_big(lbig *b, lbig *e, lbig *m) {
+
+  lbig *one = lbig_from_long(1);
+  lbig *r = lbig_mod(one, m);
+  lbig *x = lbig_mod(b, m);
+  if (x->neg) {
+    lbig *t = lbig_add(x, m);
+    free(x);
+    x = t;
+  }
+  long bits = lbig_bits(e);
+  for (long i = 0; i < bits; i++) {
+    if (e->d[i / 32] >> (i % 32) & 1) {
+      lbig *t = lbig_mul(r, x);
+      free(r);
+      r = lbig_mod(t, m);
+      free(t);
+    }
+    lbig *t = lbig_mul(x, x);
+    free(x);
+    x = lbig_mod(t, m);
+    free(t);
+  }
+  free(one);
+  free(x);
+  lval *v = lval_big(r);
+  lval_big_demote(v);
+  return v;
+}
+
+/* Raise base to exp modulo mod */
+lval *builtin_powmod(lval *a, int op) {
+
+  if (a->count != 3) {
+    lval_del(a);
+    return lval_err("Function 'powmod' passed incorrect number of arguments!");
+  }
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_NUM && a->cell[i]->type != LVAL_BIG) {
+      lval_del(a);
+      return lval_err("Function 'powmod' passed incorrect types!");
+    }
+  }
+  lbig *bb = lval_to_big(a->cell[0]);
+  lbig *eb = lval_to_big(a->cell[1]);
+  lbig *mb = lval_to_big(a->cell[2]);
+  int words = a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM
+    && a->cell[2]->type == LVAL_NUM;
+  long b = words ? a->cell[0]->num : 0;
+  long e = words ? a->cell[1]->num : 0;
+  long m = words ? a->cell[2]->num : 0;
+  lval_del(a);
+
+  lval *r = NULL;
+  if (mb->neg || !mb->len) {
+    r = lval_err("Function 'powmod' passed non-positive modulus!");
+  } else if (eb->neg) {
+    r = lval_err("Function 'powmod' passed negative exponent!");
+  } else if (!words) {
+    r = lval_powmod_big(bb, eb, mb);
+  }
+  free(bb);
+  free(eb);
+  free(mb);
+  if (r) {
+    return r;
+  }
+
+  long x = 1 % m;
+  b %= m;
+  if (b < 0) {
+    b += m;
+  }
+  for (; e; e >>= 1) {
+    if (e & 1) {
+      x = lval_mulmod(x, b, m);
+    }
+    b = lval_mulmod(b, b, m);
+  }
+  return lval_num(x);
+}
+
+/* Evaluate through the bytecode VM rather than walking the tree */
+int lval_use_vm = 1;
+
+lval *lval_run(lval *v);
+
+lval *builtin_eval(lval *a, int op) {
+
+  if (a->count != 1) {
+    lval_del(a);
+    return lval_err("Function 'eval' passed too many arguments!");
+  }
+  if (a->cell[0]->type == LVAL_VEC) {
+    a->cell[0] = lval_vec_expand(a->cell[0]);
+  }
+  if (a->cell[0]->type != LVAL_QEXPR) {
+    lval_del(a);
+    return lval_err("Function 'eval' passed incorrect types!");
+  }
+  /* the Sexpr is evaluated by the caller, so a chain of evals does not
+     nest and an eval in tail position reuses the running evaluation */
+  lval *x = lval_own(lval_take(a, 0));
+  x->type = LVAL_SEXPR;
+  x->flags |= LVAL_TAIL;
+  return x;
+}
+
+/* Evaluate the Sexpr eval left, or give back any other value */
+lval *lval_force(lval *x) {
+
+  if (x->flags & LVAL_TAIL) {
+    x->flags &= ~LVAL_TAIL;
+    return lval_run(x);
+  }
+  return x;
+}
+
+/* Store element i of list l as a double, returning 0 if it is no number */
+int lval_elem_dbl(lval *l, int i, double *x) {
+
+  if (l->type == LVAL_VEC) {
+    *x = l->flags & LVAL_DOUBLES ? l->dbls[i] : (double)l->nums[i];
+    return 1;
+  }
+  int t = l->cell[i]->type;
+  if (t != LVAL_NUM && t != LVAL_BIG && t != LVAL_DBL) {
+    return 0;
+  }
+  *x = lval_to_dbl(l->cell[i]);
+  return 1;
+}
+
+/* Build a matrix from a Qexpr of rows, a flat list makes a single row */
+lval *builtin_matrix(lval *a, int op) {
+
+  if (a->count != 1) {
+    lval_del(a);
+    return lval_err("Function 'matrix' passed too many arguments!");
+  }
+  lval *l = a->cell[0];
+  if (lval_list_len(l) < 0) {
+    lval_del(a);
+    return lval_err("Function 'matrix' passed incorrect types!");
+  }
+  if (l->count == 0) {
+    lval_del(a);
+    return lval_err("Function 'matrix' passed {}!");
+  }
+  int flat = l->type == LVAL_VEC || lval_list_len(l->cell[0]) < 0;
+  int rows = flat ? 1 : l->count;
+  int cols = flat ? l->count : l->cell[0]->count;
+  char *err = cols ? NULL : "Function 'matrix' passed {}!";
+  lmat *m = lmat_new(rows, cols);
+  for (int i = 0; i < rows && !err; i++) {
+    lval *row = flat ? l : l->cell[i];
+    if (lval_list_len(row) != cols) {
+      err = "Function 'matrix' passed rows of different lengths!";
+    }
+    for (int j = 0; j < cols && !err; j++) {
+      if (!lval_elem_dbl(row, j, &m->d[i * cols + j])) {
+        err = "Function 'matrix' passed incorrect types!";
+      }
+    }
+  }
+  lval_del(a);
+  if (err) {
+    free(m);
+    return lval_err(err);
+  }
+  return lval_mat(m);
+}
+
+/* Get the rows of a matrix as a Qexpr of vectors */
+lval *builtin_rows(lval *a, int op) {
+
+  if (a->count != 1) {
+    lval_del(a);
+    return lval_err("Function 'rows' passed too many arguments!");
+  }
+  if (a->cell[0]->type != LVAL_MAT) {
+    lval_del(a);
+    return lval_err("Function 'rows' passed incorrect types!");
+  }
+  lmat *m = a->cell[0]->mat;
+  lval *x = lval_qexpr();
+  lval_reserve(x, m->rows);
+  for (int i = 0; i < m->rows; i++) {
+    lval *row = lval_vec(m->cols, 1);
+    memcpy(row->dbls, &m->d[i * m->cols], sizeof(double) * m->cols);
+    x = lval_add(x, row);
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Get the number of rows and columns of a matrix */
+lval *builtin_shape(lval *a, int op) {
+
+  if (a->count != 1) {
+    lval_del(a);
+    return lval_err("Function 'shape' passed too many arguments!");
+  }
+  if (a->cell[0]->type != LVAL_MAT) {
+    lval_del(a);
+    return lval_err("Function 'shape' passed incorrect types!");
+  }
+  lval *x = lval_vec(2, 0);
+  x->nums[0] = a->cell[0]->mat->rows;
+  x->nums[1] = a->cell[0]->mat->cols;
+  lval_del(a);
+  return x;
+}
+
+/* Swap the rows and columns of a matrix */
+lval *builtin_transpose(lval *a, int op) {
+
+  if (a->count != 1) {
+    lval_del(a);
+    return lval_err("Function 'transpose' passed too many arguments!");
+  }
+  if (a->cell[0]->type != LVAL_MAT) {
+    lval_del(a);
+    return lval_err("Function 'transpose' passed incorrect types!");
+  }
+  lval *x = lval_mat(lmat_transpose(a->cell[0]->mat));
+  lval_del(a);
+  return x;
+}
+
+/* Multiply matrices from left to right */
+lval *builtin_matmul(lval *a, int op) {
+
+  if (a->count < 2) {
+    lval_del(a);
+    return lval_err("Function 'matmul' passed incorrect number of arguments!");
+  }
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_MAT) {
+      lval_del(a);
+      return lval_err("Function 'matmul' passed incorrect types!");
+    }
+  }
+  lval *x = lval_pop(a, 0);
+  while (a->count) {
+    lval *y = lval_pop(a, 0);
+    lmat *l = x->mat;
+    lmat *r = y->mat;
+    if (l->cols != r->rows) {
+      lval_del(x);
+      lval_del(y);
+      lval_del(a);
+      return lval_err("Function 'matmul' passed incompatible shapes!");
+    }
+    lmat *m = lmat_new(l->rows, r->cols);
+    memset(m->d, 0, sizeof(double) * m->rows * m->cols);
+    lval_vec_kernels.mat_mul(m->d, l->d, r->d, l->rows, l->cols, r->cols);
+    lval_del(x);
+    lval_del(y);
+    x = lval_mat(m);
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Print counters of nodes by the type they were allocated as, nursery
+   included, arguments are ignored */
+lval *builtin_alloc_stats(lval *a, int op) {
+
+  char *names[] = { "number", "bignum", "double", "error", "symbol", "function",
+    "sexpr", "qexpr", "vector", "matrix" };
+  long allocs = 0;
+  long frees = 0;
+  for (int t = 0; t < LVAL_TYPES; t++) {
+    printf("%-8s allocs: %li frees: %li\n", names[t],
+      lval_pool.allocs[t], lval_pool.frees[t]);
+    allocs += lval_pool.allocs[t];
+    frees += lval_pool.frees[t];
+  }
+  printf("slabs: %li (%li bytes) live nodes: %li\n", lval_pool.slab_count,
+    lval_pool.slab_count * (long)sizeof(lval_slab), allocs - frees);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Print collector counters, arguments are ignored */
+lval *builtin_gc_stats(lval *a, int op) {
+
+  printf("collections: %li promoted: %li bytes swept: %li nodes\n",
+    lval_gc.collections, lval_gc.promoted * (long)sizeof(lval), lval_gc.swept);
+  printf("pause total: %.3f ms max: %.3f ms nursery: %i/%i nodes\n",
+    lval_gc.pause_total * 1000, lval_gc.pause_max * 1000, lval_gc.used,
+    LVAL_NURSERY_NODES);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Builtins by opcode */
+lbuiltin lval_builtins[LFUN_COUNT] = {
+  builtin_op, builtin_op, builtin_op, builtin_op, builtin_op, builtin_op,
+  builtin_op, builtin_op, builtin_list, builtin_head, builtin_tail,
+  builtin_join, builtin_eval, builtin_powmod, builtin_op, builtin_matrix,
+  builtin_rows, builtin_shape, builtin_transpose, builtin_matmul,
+  builtin_alloc_stats, builtin_gc_stats
+};
+
+/* Intern the names of the builtins */
+void lval_builtins_init(void) {
+
+  for (int i = 0; i < LFUN_COUNT; i++) {
+    lval_fun_names[i] = lval_intern(lval_fun_names[i]);
+  }
+  lval_vec_init();
+  lval_dbl_init();
+}
+
+/* Get opcode of the builtin with interned name, or -1 */
+int lval_builtin_op(char *name) {
+
+  for (int i = 0; i < LFUN_COUNT; i++) {
+    if (lval_fun_names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Create lval for symbol, bound to its builtin when there is one */
+lval *lval_read_sym(char *s) {
+
+  char *name = lval_intern(s);
+  int op = lval_builtin_op(name);
+  return op >= 0 ? lval_fun(lval_builtins[op], op) : lval_sym(name);
+}
+
+/* Apply owned Sexpr whose children are evaluated */
+lval *lval_apply(lval *v) {
+
+  /* error cheching */
+  for (int i = 0; i < v->count; i++) {
+    if (v->cell[i]->type == LVAL_ERR) {
+      return lval_take(v, i);
+    }
+  }
+
+  if (v->count == 0) {
+    return v;
+  }
+  if (v->count == 1) {
+    return lval_take(v, 0);
+  }
+
+  lval *f = lval_pop(v, 0);
+  if (f->type == LVAL_SYM) {
+    lval_del(f);
+    lval_del(v);
+    return lval_err("Unknown Function!");
+  }
+  if (f->type != LVAL_FUN) {
+    lval_del(f);
+    lval_del(v);
+    return lval_err("S-expression Does not start with symbol!");
+  }
+
+  lval *result = f->fun(v, f->op);
+  lval_del(f);
+  return result;
+}
+
+/* Whether builtin op always gives the same value for the same arguments.
+   The stats builtins come last */
+int lval_op_pure(int op) {
+
+  return op != LFUN_EVAL && op < LFUN_ALLOC_STATS;
+}
+
+/* Fold owned Sexpr v whose children are folded */
+lval *lval_fold_sexpr(lval *v) {
+
+  int literals = 1;
+  for (int i = 0; i < v->count; i++) {
+    literals &= v->cell[i]->type != LVAL_SEXPR || v->cell[i]->count == 0;
+  }
+  if (v->count == 1) {
+    return lval_take(v, 0);
+  }
+  lval *f = v->cell[0];
+  if (!literals || f->type != LVAL_FUN || !lval_op_pure(f->op)) {
+    return v;
+  }
+  return lval_apply(v);
+}
+
+/* Fold calls of pure builtins on literal arguments and collapse single
+   element Sexprs, giving an expression of the same value. Takes
+   ownership of v */
+lval *lval_fold(lval *v) {
+
+  if (v->type != LVAL_SEXPR || v->count == 0) {
+    return v;
+  }
+  lval_stack s;
+  lval_stack_init(&s);
+  lval_stack_push(&s, lval_own(v), 0);
+  for (;;) {
+    lval_frame *f = &s.frames[s.count - 1];
+    if (f->i < f->v->count) {
+      lval *x = f->v->cell[f->i];
+      if (x->type == LVAL_SEXPR && x->count) {
+        f->v->cell[f->i] = x = lval_own(x);
+        lval_stack_push(&s, x, 0);
+      } else {
+        f->i++;
+      }
       continue;
     }
-    if (strcmp(t->children[i]->tag, "regex") == 0) {
-      continue;
+    v = lval_fold_sexpr(f->v);
+    if (--s.count == 0) {
+      break;
     }
-    x = lval_add(x, lval_read(t->children[i]));
+    f = &s.frames[s.count - 1];
+    f->v->cell[f->i++] = v;
   }
-
-  return x;
+  lval_stack_release(&s);
+  return v;
 }
 
-/* Delete lval */
-void lval_del(lval *v) {
+/* Instructions of the bytecode, each followed by its operands */
+enum {
+  LOP_CONST,  /* index: push constant */
+  LOP_APPLY,  /* n: apply the n values on top as an evaluated Sexpr */
+  LOP_CALL,   /* op, n: call builtin op on the n values on top */
+  LOP_RET     /* return the value on top */
+};
 
-  switch (v->type) {
+/* Bytecode compiled from an expression, with the constants it pushes.
+   Constants are moved onto the stack, so a program runs once */
+typedef struct {
+  int *code;
+  int len;
+  int cap;
+  lval **consts;
+  int const_count;
+  int const_cap;
+  int depth;
+  int max_depth;
+} lprog;
 
-    case LVAL_NUM:
-      break;
-    case LVAL_SYM:
-      free(v->sym);
-      break;
-    case LVAL_ERR:
-      free(v->err);
-      break;
-    /* Delete all elements*/  
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
-      }
-      free(v->cell);
-      break;
+/* Append a word of code */
+void lprog_emit(lprog *p, int w) {
+
+  if (p->len == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 64;
+    p->code = realloc(p->code, sizeof(int) * p->cap);
   }
-  free(v);
+  p->code[p->len++] = w;
 }
 
-/* Get lval without deleting lval children */
-lval *lval_pop(lval *v, int i) {
+/* Track the stack depth reached after an instruction pushing push values
+   and popping pop values */
+void lprog_stack(lprog *p, int pop, int push) {
 
-  lval *x = v->cell[i];
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
-  v->count--;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  return x;
+  p->depth += push - pop;
+  if (p->depth > p->max_depth) {
+    p->max_depth = p->depth;
+  }
 }
 
-/* Get lval (delet children) */
-lval *lval_take(lval *v, int i) {
+/* Compile code pushing constant v */
+void lprog_const(lprog *p, lval *v) {
 
-  lval *x = lval_pop(v, i);
-  lval_del(v);
-  return x;
+  if (p->const_count == p->const_cap) {
+    p->const_cap = p->const_cap ? p->const_cap * 2 : 64;
+    p->consts = realloc(p->consts, sizeof(lval *) * p->const_cap);
+  }
+  lprog_emit(p, LOP_CONST);
+  lprog_emit(p, p->const_count);
+  p->consts[p->const_count++] = v;
+  lprog_stack(p, 0, 1);
 }
 
+/* Compile code applying n values, or calling builtin op on n values */
+void lprog_apply(lprog *p, int op, int n) {
 
-/* Join lval */
-lval *lval_join(lval *x ,lval *y) {
-
-  while(y->count) {
-    x = lval_add(x, lval_pop(y,0));
+  if (op >= 0) {
+    lprog_emit(p, LOP_CALL);
+    lprog_emit(p, op);
+  } else {
+    lprog_emit(p, LOP_APPLY);
   }
-  lval_del(y);
-  return x;
+  lprog_emit(p, n);
+  lprog_stack(p, n, 1);
 }
 
-void lval_print(lval *v);
+/* Whether Sexpr v is compiled as a call of the builtin it starts with */
+int lprog_is_call(lval *v) {
 
-/* Print lval expr */
-void lval_expr_print(lval *v, char open, char close) {
+  return v->count >= 2 && v->cell[0]->type == LVAL_FUN;
+}
 
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
+/* Compile code pushing the value of v, taking ownership of v.
+   v is folded first, so every program and every Sexpr eval gives the
+   VM only runs what is left of its literal calls. Sexprs starting with
+   a builtin call it directly, and a Sexpr of one value is that value,
+   so an eval in it stays in tail position */
+void lprog_compile(lprog *p, lval *v) {
 
-    lval_print(v->cell[i]);
+  lval_stack s;
+  lval_stack_init(&s);
+  v = lval_fold(v);
+  while (v) {
+    while (v->type == LVAL_SEXPR && v->count == 1) {
+      v = lval_take(v, 0);
+    }
+    if (v->type != LVAL_SEXPR || v->count == 0) {
+      lprog_const(p, v);
+    } else {
+      v = lval_own(v);
+      lval_stack_push(&s, v, lprog_is_call(v));
+    }
 
-    if (i != (v->count - 1)) {
-      putchar(' ');
+    /* compile the next child of the innermost Sexpr, finishing the
+       Sexprs whose children are all compiled */
+    v = NULL;
+    while (s.count && !v) {
+      lval_frame *f = &s.frames[s.count - 1];
+      if (f->i < f->v->count) {
+        v = f->v->cell[f->i++];
+        continue;
+      }
+      lval *x = f->v;
+      int call = lprog_is_call(x);
+      lprog_apply(p, call ? x->cell[0]->op : -1, x->count - call);
+      if (call) {
+        lval_del(x->cell[0]);
+      }
+      x->count = 0;
+      lval_del(x);
+      s.count--;
     }
   }
-  putchar(close);
+  lval_stack_release(&s);
 }
 
-/* Print lval */
-void lval_print(lval *v) {
+/* Compile code pushing the value of parser output, like lprog_compile on
+   what lval_read gives but without building the Sexprs */
+void lprog_compile_ast(lprog *p, mpc_ast_t *t) {
 
-  switch (v->type) {
-  case LVAL_NUM:
-    printf("%li", v->num);
-    break;
-  case LVAL_ERR:
-    free(v->err);
-    break;
-  case LVAL_SYM:
-    printf("%s", v->sym);
-    break;
-  case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
-    break;
-    break;
-  case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
-    break;
-    break;    
+  if (!strstr(t->tag, ">") || strstr(t->tag, "qexpr")) {
+    lprog_const(p, lval_read(t));
+    return;
+  }
+  int n = 0;
+  mpc_ast_t *head = NULL;
+  for (int i = 0; i < t->children_num; i++) {
+    if (!lval_read_skip(t->children[i])) {
+      head = n++ ? head : t->children[i];
+    }
+  }
+  if (n == 0) {
+    lprog_const(p, lval_sexpr());
+    return;
+  }
+  if (n == 1) {
+    lprog_compile_ast(p, head);
+    return;
+  }
+  int op = -1;
+  if (n >= 2 && strstr(head->tag, "symbol")) {
+    op = lval_builtin_op(lval_intern(head->contents));
   }
+  for (int i = 0; i < t->children_num; i++) {
+    mpc_ast_t *c = t->children[i];
+    if (!lval_read_skip(c) && !(c == head && op >= 0)) {
+      lprog_compile_ast(p, c);
+    }
+  }
+  lprog_apply(p, op, op >= 0 ? n - 1 : n);
 }
 
-void lval_println(lval *v) {
+/* Free program and the constants it did not push */
+void lprog_release(lprog *p) {
 
-  lval_print(v);
-  putchar('\n');
+  for (int i = 0; i < p->const_count; i++) {
+    if (p->consts[i]) {
+      lval_del(p->consts[i]);
+    }
+  }
+  free(p->consts);
+  free(p->code);
 }
 
-lval *lval_eval_sexpr(lval *v);
+/* Move n values into a new Sexpr */
+lval *lval_vm_sexpr(lval **x, int n) {
 
-/* Evaluate lval */
-lval *lval_eval(lval *v) {
-
-  if (v->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(v);
-  }
+  lval *v = lval_sexpr();
+  lval_reserve(v, n);
+  memcpy(v->cell, x, sizeof(lval *) * n);
+  v->count = n;
   return v;
 }
 
-/* Get Qexpr with only the first element */
-lval *builtin_head(lval *a) {
+/* Call builtin op on n evaluated arguments. Machine word arithmetic is
+   done in the node of the first argument, without building a Sexpr */
+lval *lval_vm_call(int op, lval **x, int n) {
 
-  if (a->count != 1) {
-    lval_del(a);
-    return lval_err("Function 'head' passed too many arguments!");
+  for (int i = 0; i < n; i++) {
+    if (x[i]->type == LVAL_ERR) {
+      /* like lval_apply, the first error wins */
+      for (int j = 0; j < n; j++) {
+        if (j != i) {
+          lval_del(x[j]);
+        }
+      }
+      return x[i];
+    }
   }
-  if (a->cell[0]->type != LVAL_QEXPR) {
-    lval_del(a);
-    return lval_err("Function 'head' passed incorrect types!");
+  if (op <= LFUN_MAX && n <= LVAL_OP_BLOCK && x[0]->type == LVAL_NUM
+    && x[0]->refs == 1) {
+    long y[LVAL_OP_BLOCK];
+    int nums = 1;
+    for (int i = 1; i < n; i++) {
+      nums &= x[i]->type == LVAL_NUM;
+      y[i - 1] = nums ? x[i]->num : 0;
+    }
+    long r = x[0]->num;
+    int of = !nums || ((op == LFUN_DIV || op == LFUN_MOD)
+      && lval_op_has_zero(y, n - 1));
+    if (!of && n == 1) {
+      of = op == LFUN_SUB && r == LONG_MIN;
+      if (!of && op == LFUN_SUB) {
+        r = -r;
+      }
+    } else if (!of) {
+      of = lval_op_kernel(op, &r, y, n - 1);
+    }
+    if (!of) {
+      for (int i = 1; i < n; i++) {
+        lval_del(x[i]);
+      }
+      x[0]->num = r;
+      return x[0];
+    }
   }
-  if (a->cell[0]->count == 0) {
-    lval_del(a);
-    return lval_err("Function 'head' passed {}!");
+  return lval_builtins[op](lval_vm_sexpr(x, n), op);
+}
+
+/* Program running in the VM, with its own value stack. Frames of the
+   programs of nested evals are kept on the heap instead of the C stack */
+typedef struct {
+  lprog *p;
+  lval **stack;
+  int sp;
+  int *pc;
+  int roots;
+} lvm_frame;
+
+/* Start running program p in frame f, rooting its values while collecting.
+   Values only live on the stack and in the constants, which are moved out
+   of it as they are pushed */
+void lvm_frame_start(lvm_frame *f, lprog *p) {
+
+  f->p = p;
+  f->stack = calloc(p->max_depth + 1, sizeof(lval *));
+  f->sp = 0;
+  f->pc = p->code;
+  f->roots = 0;
+  if (lval_gc.enabled) {
+    for (int i = 0; i < p->max_depth; i++) {
+      lval_gc_root(&f->stack[i]);
+    }
+    for (int i = 0; i < p->const_count; i++) {
+      lval_gc_root(&p->consts[i]);
+    }
+    f->roots = p->max_depth + p->const_count;
   }
-  lval* v = lval_take(a, 0);
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
 }
 
-/* Get Qexpr without the first element */
-lval* builtin_tail(lval* a) {
+/* Stop the topmost frame f, freeing its program when it ran an eval */
+void lvm_frame_end(lvm_frame *f, int owned) {
 
-  if (a->count != 1) {
-    lval_del(a);
-    return lval_err("Function 'tail' passed too many arguments!");
+  lval_gc_unroot(f->roots);
+  free(f->stack);
+  if (owned) {
+    lprog_release(f->p);
+    free(f->p);
   }
-  if (a->cell[0]->type != LVAL_QEXPR) {
-    lval_del(a);
-    return lval_err("Function 'tail' passed incorrect types!");
+}
+
+/* Run program, using computed goto dispatch where the compiler has it.
+   Sexprs that eval leaves run in a frame on top, which replaces the
+   running frame when the eval is in tail position */
+lval *lprog_run(lprog *p) {
+
+  lvm_frame local[LVAL_STACK_MIN];
+  lvm_frame *frames = local;
+  int count = 1;
+  int cap = LVAL_STACK_MIN;
+  lvm_frame_start(&frames[0], p);
+  lval **stack = frames[0].stack;
+  lval **consts = p->consts;
+  int sp = 0;
+  int *pc = p->code;
+  lval *result = NULL;
+
+#if defined(__GNUC__)
+  static void *labels[] = { &&op_const, &&op_apply, &&op_call, &&op_ret };
+#define LVM_NEXT goto *labels[*pc++]
+#define LVM_OP(name, op) name
+  LVM_NEXT;
+#else
+#define LVM_NEXT continue
+#define LVM_OP(name, op) case op
+  for (;;) switch (*pc++) {
+#endif
+
+  LVM_OP(op_const, LOP_CONST): {
+    stack[sp++] = consts[*pc];
+    consts[*pc++] = NULL;
+    LVM_NEXT;
   }
-  if (a->cell[0]->count == 0) {
-    lval_del(a);
-    return lval_err("Function 'tail' passed {}!");
+  LVM_OP(op_apply, LOP_APPLY): {
+    int n = *pc++;
+    if (lval_gc.pending) {
+      lval_gc_collect();
+    }
+    sp -= n;
+    lval *v = lval_apply(lval_vm_sexpr(stack + sp, n));
+    memset(stack + sp, 0, sizeof(lval *) * n);
+    stack[sp++] = v;
+    if (v->flags & LVAL_TAIL) {
+      goto lvm_eval;
+    }
+    LVM_NEXT;
   }
-  lval* v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
+  LVM_OP(op_call, LOP_CALL): {
+    int op = *pc++;
+    int n = *pc++;
+    if (lval_gc.pending) {
+      lval_gc_collect();
+    }
+    sp -= n;
+    lval *v = lval_vm_call(op, stack + sp, n);
+    memset(stack + sp, 0, sizeof(lval *) * n);
+    stack[sp++] = v;
+    if (v->flags & LVAL_TAIL) {
+      goto lvm_eval;
+    }
+    LVM_NEXT;
+  }
+  LVM_OP(op_ret, LOP_RET): {
+    lval *v = stack[--sp];
+    stack[sp] = NULL;
+    if (count == 1) {
+      result = v;
+      goto lvm_done;
+    }
+    /* give the value of the eval to the frame that ran it */
+    lvm_frame_end(&frames[--count], 1);
+    lvm_frame *f = &frames[count - 1];
+    stack = f->stack;
+    consts = f->p->consts;
+    sp = f->sp;
+    pc = f->pc;
+    stack[sp++] = v;
+    LVM_NEXT;
+  }
+
+  lvm_eval: {
+    lval *v = stack[--sp];
+    stack[sp] = NULL;
+    v->flags &= ~LVAL_TAIL;
+    if (*pc == LOP_RET && count > 1) {
+      lvm_frame_end(&frames[--count], 1);
+    } else {
+      frames[count - 1].sp = sp;
+      frames[count - 1].pc = pc;
+    }
+    if (count == cap) {
+      cap *= 2;
+      if (frames == local) {
+        frames = malloc(sizeof(lvm_frame) * cap);
+        memcpy(frames, local, sizeof(local));
+      } else {
+        frames = realloc(frames, sizeof(lvm_frame) * cap);
+      }
+    }
+    lprog *e = calloc(1, sizeof(lprog));
+    lprog_compile(e, v);
+    lprog_emit(e, LOP_RET);
+    lvm_frame_start(&frames[count++], e);
+    stack = frames[count - 1].stack;
+    consts = e->consts;
+    sp = 0;
+    pc = e->code;
+    LVM_NEXT;
+  }
+
+#if !defined(__GNUC__)
+  }
+#endif
+#undef LVM_NEXT
+#undef LVM_OP
+
+lvm_done:
+  lvm_frame_end(&frames[0], 0);
+  if (frames != local) {
+    free(frames);
+  }
+  return result;
 }
 
-/* Get Qexpr from Sexpr */
-lval* builtin_list(lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
+/* Finish compiled program, run it and free it */
+lval *lprog_finish(lprog *p) {
+
+  lprog_emit(p, LOP_RET);
+  lval *x = lprog_run(p);
+  lprog_release(p);
+  return x;
 }
 
-lval* builtin_join(lval* a) {
+/* Evaluate lval with the VM unless the tree walker was asked for */
+lval *lval_run(lval *v) {
 
-  for (int i = 0; i < a->count; i++) {
-    if (a->cell[i]->type != LVAL_QEXPR) {
-      lval_del(a);
-      return lval_err("Function 'tail' passed incorrect types!");
-    }
+  if (!lval_use_vm) {
+    return lval_eval(v);
   }
-  lval* x = lval_pop(a, 0);
-  while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
+  lprog p = { 0 };
+  lprog_compile(&p, v);
+  return lprog_finish(&p);
+}
+
+/* Evaluate parser output, compiling it straight to bytecode for the VM */
+lval *lval_run_ast(mpc_ast_t *t) {
+
+  if (!lval_use_vm) {
+    return lval_eval(lval_read(t));
   }
-  lval_del(a);
-  return x;
+  lprog p = { 0 };
+  lprog_compile_ast(&p, t);
+  return lprog_finish(&p);
 }
 
-/* Handle operations */
-lval *builtin_op(lval *a, char *op) {
+/* Read input through mpc_ast_t and lval_read instead of the direct reader */
+int lval_use_ast = 0;
 
-  for (int i = 0; i < a->count; i++) {
-    if (a->cell[i]->type != LVAL_NUM) {
-      lval_del(a);
-      return lval_err("Cannot operate on non-number!");
+/* Evaluate every expression of a file, printing each result */
+int lval_run_file(char *path, mpc_parser_t *p) {
+
+  mpc_result_t r;
+  if (lval_use_ast ? !mpc_parse_contents(path, p, &r)
+    : !lval_parse_file(path, p, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 1;
+  }
+  if (lval_use_ast) {
+    mpc_ast_t *t = r.output;
+    for (int i = 0; i < t->children_num; i++) {
+      if (!lval_read_skip(t->children[i])) {
+        lval *x = lval_run_ast(t->children[i]);
+        lval_println(x);
+        lval_del(x);
+      }
     }
+    mpc_ast_delete(r.output);
+    return 0;
   }
-  lval *x = lval_pop(a, 0);
 
-  /* unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+  /* expressions still to run stay live while the others run */
+  lval *v = r.output;
+  lval_gc_root(&v);
+  while (v->count) {
+    lval *x = lval_run(lval_pop(v, 0));
+    lval_println(x);
+    lval_del(x);
   }
+  lval_gc_unroot(1);
+  lval_del(v);
+  return 0;
+}
 
-  while (a->count > 0) {
+/* Emit C constant expression of double x, exact with hex floats */
+void lval_emit_dbl(FILE *out, double x) {
 
-    lval *y = lval_pop(a, 0);
+  if (isnan(x)) {
+    fprintf(out, signbit(x) ? "-NAN" : "NAN");
+  } else if (isinf(x)) {
+    fprintf(out, x < 0 ? "-INFINITY" : "INFINITY");
+  } else {
+    fprintf(out, "%a", x);
+  }
+}
 
-    if (strcmp(op, "+") == 0) {
-      x->num += y->num;
-    }
-    if (strcmp(op, "-") == 0) {
-      x->num -= y->num;
-    }
-    if (strcmp(op, "*") == 0) {
-      x->num *= y->num;
-    }
-    if (strcmp(op, "/") == 0) {
+/* Emit the n-th constant's count elements, nums or else dbls, as the
+   static array cn_d */
+void lval_emit_array(FILE *out, int n, long *nums, double *dbls, int count) {
 
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division By Zero!");
-        break;
-      }
-      x->num /= y->num;
+  fprintf(out, "  static %s c%i_d[] = {", nums ? "long" : "double", n);
+  for (int i = 0; i < count; i++) {
+    fprintf(out, i ? ", " : "");
+    if (!nums) {
+      lval_emit_dbl(out, dbls[i]);
+    } else if (nums[i] == LONG_MIN) {
+      fprintf(out, "LONG_MIN");
+    } else {
+      fprintf(out, "%liL", nums[i]);
     }
-    if (strcmp(op, "%") == 0) {
+  }
+  fprintf(out, "};\n");
+}
 
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division By Zero!");
-        break;
+/* Emit C statements building constant v into variable n, leaving the
+   children of a Sexpr or Qexpr to be added */
+void lval_emit_value(FILE *out, lval *v, int n) {
+
+  switch (v->type) {
+    case LVAL_NUM:
+      if (v->num == LONG_MIN) {
+        fprintf(out, "  lval *c%i = lval_num(LONG_MIN);\n", n);
+      } else {
+        fprintf(out, "  lval *c%i = lval_num(%liL);\n", n, v->num);
       }
-      x->num %= y->num;
-    }
-    if (strcmp(op, "^") == 0) {
-      x->num = pow(x->num, y->num);
+      break;
+    case LVAL_BIG: {
+      char *s = lbig_to_str(v->big);
+      fprintf(out, "  lval *c%i = lval_big(lbig_from_str(\"%s\"));\n", n, s);
+      free(s);
+      break;
     }
-    if (strcmp(op, "min") == 0) {
-      if (x->num > y->num) {
-        x->num = y->num;
+    case LVAL_DBL:
+      fprintf(out, "  lval *c%i = lval_dbl(", n);
+      lval_emit_dbl(out, v->dbl);
+      fprintf(out, ");\n");
+      break;
+    case LVAL_SYM:
+      fprintf(out, "  lval *c%i = lval_sym(lval_intern(\"%s\"));\n", n, v->sym);
+      break;
+    case LVAL_ERR:
+      fprintf(out, "  lval *c%i = lval_err(\"%s\");\n", n, v->err);
+      break;
+    case LVAL_FUN:
+      fprintf(out, "  lval *c%i = lval_fun(lval_builtins[%i], %i); /* %s */\n",
+        n, v->op, v->op, lval_fun_names[v->op]);
+      break;
+    case LVAL_VEC: {
+      int dbl = v->flags & LVAL_DOUBLES;
+      fprintf(out, "  lval *c%i = lval_vec(%i, %i);\n", n, v->count,
+        dbl ? 1 : 0);
+      if (v->count) {
+        lval_emit_array(out, n, dbl ? NULL : v->nums, dbl ? v->dbls : NULL,
+          v->count);
+        fprintf(out, "  memcpy(c%i->nums, c%i_d, sizeof(c%i_d));\n", n, n, n);
       }
+      break;
     }
-    if (strcmp(op, "max") == 0) {
-      if (x->num < y->num) {
-        x->num = y->num;
+    case LVAL_MAT: {
+      int size = v->mat->rows * v->mat->cols;
+      fprintf(out, "  lval *c%i = lval_mat(lmat_new(%i, %i));\n", n,
+        v->mat->rows, v->mat->cols);
+      if (size) {
+        lval_emit_array(out, n, NULL, v->mat->d, size);
+        fprintf(out, "  memcpy(c%i->mat->d, c%i_d, sizeof(c%i_d));\n", n, n,
+          n);
       }
+      break;
     }
-    lval_del(y);
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      fprintf(out, "  lval *c%i = %s;\n", n,
+        v->type == LVAL_SEXPR ? "lval_sexpr()" : "lval_qexpr()");
+      break;
   }
-
-  lval_del(a);
-  return x;
 }
 
-lval *builtin_eval(lval *a) {
+/* Emit C statements building constant v into new variables, returning
+   the number of the one holding v. Variables are numbered in the order
+   a work stack visits the nested expressions, the variables of those
+   being filled in kept alongside their frames */
+int lval_emit_const(FILE *out, lval *v, int *vars) {
 
-  if (a->count != 1) {
-    lval_del(a);
-    return lval_err("Function 'eval' passed too many arguments!");
-  }
-  if (a->cell[0]->type != LVAL_QEXPR) {
-    lval_del(a);
-    return lval_err("Function 'eval' passed incorrect types!");
+  lval_stack s;
+  lval_stack_init(&s);
+  int *ids = NULL;
+  int cap = 0;
+  int first = *vars;
+  for (;;) {
+    int n = (*vars)++;
+    lval_emit_value(out, v, n);
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->count) {
+      lval_stack_push(&s, v, 0);
+      if (s.count > cap) {
+        cap = s.cap;
+        ids = realloc(ids, sizeof(int) * cap);
+      }
+      ids[s.count - 1] = n;
+    } else if (s.count) {
+      fprintf(out, "  c%i = lval_add(c%i, c%i);\n", ids[s.count - 1],
+        ids[s.count - 1], n);
+    }
+
+    /* add the expressions whose children are all built to their parent */
+    v = NULL;
+    while (s.count && !v) {
+      lval_frame *f = &s.frames[s.count - 1];
+      if (f->i < f->v->count) {
+        v = f->v->cell[f->i++];
+      } else if (--s.count) {
+        fprintf(out, "  c%i = lval_add(c%i, c%i);\n", ids[s.count - 1],
+          ids[s.count - 1], ids[s.count]);
+      }
+    }
+    if (!v) {
+      break;
+    }
   }
-  lval *x = lval_take(a,0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(x);
-}
-
-lval* builtin(lval* a, char* func) {
-  
-  if (strcmp("list", func) == 0) { return builtin_list(a); }
-  if (strcmp("head", func) == 0) { return builtin_head(a); }
-  if (strcmp("tail", func) == 0) { return builtin_tail(a); }
-  if (strcmp("join", func) == 0) { return builtin_join(a); }
-  if (strcmp("eval", func) == 0) { return builtin_eval(a); }
-  if (strcmp("min", func)) { return builtin_op(a, func); }
-  if (strcmp("max", func)) { return builtin_op(a, func); }
-  if (strstr("+-/*%", func)) { return builtin_op(a, func); }
-  lval_del(a);
-  return lval_err("Unknown Function!");
+  free(ids);
+  lval_stack_release(&s);
+  return first;
 }
 
-/* Evaluate lval Sexpr */
-lval *lval_eval_sexpr(lval *v) {
-
-  /* evaluate childrens */
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(v->cell[i]);
-  }
+/* Emit compiled program as a C function, unrolling the VM loop into
+   direct calls on a stack array */
+void lprog_emit_c(lprog *p, FILE *out, int id) {
 
-  /* error cheching */
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+  int vars = 0;
+  int sp = 0;
+  fprintf(out, "lval *lispty_expr_%i(void) {\n\n", id);
+  fprintf(out, "  lval *s[%i];\n", p->max_depth);
+  for (int *pc = p->code; *pc != LOP_RET; ) {
+    switch (*pc++) {
+      case LOP_CONST: {
+        int c = lval_emit_const(out, p->consts[*pc++], &vars);
+        fprintf(out, "  s[%i] = c%i;\n", sp++, c);
+        break;
+      }
+      case LOP_APPLY: {
+        int n = *pc++;
+        sp -= n;
+        fprintf(out,
+          "  s[%i] = lval_force(lval_apply(lval_vm_sexpr(s + %i, %i)));\n",
+          sp, sp, n);
+        sp++;
+        break;
+      }
+      case LOP_CALL: {
+        int op = *pc++;
+        int n = *pc++;
+        sp -= n;
+        fprintf(out,
+          "  s[%i] = lval_force(lval_vm_call(%i, s + %i, %i)); /* %s */\n",
+          sp, op, sp, n, lval_fun_names[op]);
+        sp++;
+        break;
+      }
     }
   }
+  fprintf(out, "  return s[0];\n}\n\n");
+}
 
-  if (v->count == 0) {
-    return v;
+/* Translate every expression of a file to a C program printing their
+   values, which is built against this file compiled as LISPTY_RUNTIME */
+int lval_emit_file(char *path, mpc_parser_t *p, FILE *out) {
+
+  mpc_result_t r;
+  if (!lval_parse_file(path, p, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 1;
   }
-  if (v->count == 1) {
-    return lval_take(v, 0);
+  fprintf(out, "/* Translated from %s by lispty --emit-c */\n", path);
+  fprintf(out, "#define LISPTY_RUNTIME\n#include \"parsing.c\"\n\n");
+  lval *v = r.output;
+  int count = 0;
+  while (v->count) {
+    lprog prog = { 0 };
+    /* work done on literals is done once, here */
+    lprog_compile(&prog, lval_pop(v, 0));
+    lprog_emit(&prog, LOP_RET);
+    lprog_emit_c(&prog, out, count++);
+    lprog_release(&prog);
   }
+  lval_del(v);
 
-  lval *f = lval_pop(v, 0);
-  if (f->type != LVAL_SYM) {
-    lval_del(f);
-    lval_del(v);
-    return lval_err("S-expression Does not start with symbol!");
+  fprintf(out, "lval *(*lispty_exprs[])(void) = {");
+  for (int i = 0; i < count; i++) {
+    fprintf(out, "%s\n  lispty_expr_%i", i ? "," : "", i);
   }
-
-  lval *result = builtin(v, f->sym);
-  lval_del(f);
-  return result;
+  fprintf(out, "%s\n};\n\n", count ? "" : "  NULL");
+  fprintf(out, "int main(void) {\n\n");
+  fprintf(out, "  lval_builtins_init();\n");
+  fprintf(out, "  for (int i = 0; i < %i; i++) {\n", count);
+  fprintf(out, "    lval *x = lispty_exprs[i]();\n");
+  fprintf(out, "    lval_println(x);\n");
+  fprintf(out, "    lval_del(x);\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "  lval_pool_release();\n");
+  fprintf(out, "  lval_symtab_release();\n");
+  fprintf(out, "  return 0;\n}\n");
+  return 0;
 }
 
+#ifndef LISPTY_RUNTIME
 int main(int argc, char **argv) {
 
+  lval_builtins_init();
+
+  char *path = NULL;
+  int emit = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--gc") == 0) {
+      lval_gc_enable();
+    } else if (strcmp(argv[i], "--tree") == 0) {
+      lval_use_vm = 0;
+    } else if (strcmp(argv[i], "--ast") == 0) {
+      lval_use_ast = 1;
+    } else if (strcmp(argv[i], "--mpc") == 0) {
+      lval_use_mpc = 1;
+    } else if (strcmp(argv[i], "--emit-c") == 0) {
+      emit = 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
   /* Parsers for the lipsty */
+  mpc_parser_t *Decimal = mpc_new("decimal");
   mpc_parser_t *Number = mpc_new("number");
   mpc_parser_t *Symbol = mpc_new("symbol");
   mpc_parser_t *Sexpr = mpc_new("sexpr");
@@ -442,28 +4489,49 @@ int main(int argc, char **argv) {
   /* Define language grammar */
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                                                   \
+      decimal : /-?(inf|nan|[0-9]+(\\.[0-9]+([eE][+-]?[0-9]+)?|[eE][+-]?[0-9]+))/ ; \
       number  : /-?[0-9]+/ ;                                            \
       symbol  : '+' | '-' | '*' | '/' | '%' | '^' | \"min\" | \"max\"   \
-              | \"list\" | \"head\" | \"tail\" | \"join\" | \"eval\" ;  \
+              | \"list\" | \"head\" | \"tail\" | \"join\" | \"eval\"    \
+              | \"powmod\" | \"sum\" | \"matrix\" | \"rows\"           \
+              | \"shape\" | \"transpose\" | \"matmul\"                    \
+              | \"alloc-stats\" | \"gc-stats\" ;                          \
       sexpr   : '(' <expr>* ')' ;                                       \
       qexpr   :   '{' <expr>* '}' ;                                     \
-      expr    : <number> | <symbol> | <sexpr>  | <qexpr> ;              \
+      expr    : <decimal> | <number> | <symbol> | <sexpr> | <qexpr> ;   \
       lispty  : /^/ <expr>* /$/ ;                                       \
     ",
-    Number, Symbol, Sexpr, Qexpr, Expr, Lispty);
+    Decimal, Number, Symbol, Sexpr, Qexpr, Expr, Lispty);
+  lval_reader_init();
 
-  while (1) {
+  /* batch mode runs a file instead of the prompt */
+  int status = 0;
+  if (path && emit) {
+    status = lval_emit_file(path, Lispty, stdout);
+  } else if (path) {
+    status = lval_run_file(path, Lispty);
+  }
+
+  while (!path) {
 
     char *input = readline("lispty> ");
+    /* end of input */
+    if (!input) {
+      break;
+    }
     add_history(input);
 
     /* Parse the user input */
     mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispty, &r)) {
-      lval *x = lval_eval(lval_read(r.output));
+    if (lval_use_ast && mpc_parse("<stdin>", input, Lispty, &r)) {
+      lval *x = lval_run_ast(r.output);
       lval_println(x);
       lval_del(x);
       mpc_ast_delete(r.output);
+    } else if (!lval_use_ast && lval_parse("<stdin>", input, Lispty, &r)) {
+      lval *x = lval_run(r.output);
+      lval_println(x);
+      lval_del(x);
     } else {
       mpc_err_print(r.error);
       mpc_err_delete(r.error);
@@ -472,6 +4540,14 @@ int main(int argc, char **argv) {
   }
 
   /* undefine and delete  parsers */
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispty);
-  return 0;
+  mpc_cleanup(7, Decimal, Number, Symbol, Sexpr, Qexpr, Expr, Lispty);
+  lval_reader_release();
+  /* without roots a last collection releases everything */
+  if (lval_gc.enabled) {
+    lval_gc_collect();
+  }
+  lval_pool_release();
+  lval_symtab_release();
+  return status;
 }
+#endif
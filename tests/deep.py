@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Deep nesting test of lispty.
+
+Runs expressions nested a million levels deep through the reader, the
+VM, the tree walker and the collector, and checks what they print. Every
+walk over nested values uses a work stack rather than C recursion, so
+nesting is only limited by memory and none of these may crash. The same
+goes for --emit-c, whose output is also compiled and run at a depth C
+compilers get through in seconds, when cc is found.
+
+  cc -std=c11 -O2 parsing.c mpc.c -ledit -lm -o parsing
+  python3 tests/deep.py ./parsing [depth]
+"""
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+MODES = [[], ["--tree"], ["--gc"]]
+
+# levels of the emitted C that is compiled, every one a variable
+EMIT_COMPILED = 20000
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def cases(n):
+    nested = "{" * n + "1" + "}" * n
+    return [
+        ("read and print", nested, nested),
+        ("eval chain", "(eval {" * n + "3" + "})" * n, "3"),
+        ("nested evals", "(+ 1 (eval {+ 1 " * n + "0" + "}))" * n,
+         str(2 * n)),
+        ("broadcast", "(+ " + nested + " 1)", "{" * n + "2" + "}" * n),
+        ("broadcast lists", "(* {" + nested + " {3}} {2 4})",
+         "{" + "{" * n + "2" + "}" * n + " {12}}"),
+    ]
+
+
+def run(binary, args, text):
+    with tempfile.NamedTemporaryFile("w", suffix=".lspy", delete=False) as f:
+        f.write(text + "\n")
+    try:
+        p = subprocess.run([binary] + args + [f.name], capture_output=True,
+                           text=True, timeout=600)
+    finally:
+        os.unlink(f.name)
+    return p.returncode, p.stdout.rstrip("\n")
+
+
+def emit(binary, n, cc):
+    """Translate two nested constants with --emit-c and, given a compiler,
+    build and run the program. Gives the exit code and the output"""
+    nested = "{" * n + "1" + "}" * n
+    code, out = run(binary, ["--emit-c"], nested + "\n(+ " + nested + " 1)")
+    if code or not cc:
+        return code, ""
+    with tempfile.TemporaryDirectory() as d:
+        c = os.path.join(d, "deep.c")
+        exe = os.path.join(d, "deep")
+        with open(c, "w") as f:
+            f.write(out + "\n")
+        p = subprocess.run([cc, "-std=c11", "-O0", "-I", ROOT, c,
+                            os.path.join(ROOT, "mpc.c"), "-lm", "-o", exe],
+                           capture_output=True, text=True)
+        if p.returncode:
+            return p.returncode, p.stderr
+        p = subprocess.run([exe], capture_output=True, text=True)
+        return p.returncode, p.stdout.rstrip("\n")
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    binary = sys.argv[1]
+    n = int(sys.argv[2]) if len(sys.argv) > 2 else 1000000
+    bad = 0
+    for name, text, want in cases(n):
+        for args in MODES:
+            code, out = run(binary, args, text)
+            if code or out != want:
+                bad += 1
+                print("%s %s: exit %d, %r" % (name, " ".join(args), code,
+                                              out[:60]))
+    code, out = emit(binary, n, None)
+    if code:
+        bad += 1
+        print("emit-c: exit %d" % code)
+    cc = shutil.which("cc")
+    m = min(n, EMIT_COMPILED)
+    code, out = emit(binary, m, cc) if cc else (0, None)
+    if code or (out is not None and out != "{" * m + "1" + "}" * m + "\n"
+                + "{" * m + "2" + "}" * m):
+        bad += 1
+        print("emit-c compiled at %d: exit %d, %r" % (m, code, out[:60]))
+    print("%d levels, %d failures" % (n, bad))
+    sys.exit(1 if bad else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Differential test of min and max over double vectors.
+
+Feeds min and max of generated double Q-expressions to the prompt of
+`lispty` and checks the results against a left fold that keeps the
+running value unless an element compares greater (max) or less (min),
+which is how the scalar kernel folds. A NaN is only kept when it is the
+first element. Vectors run up to 40 elements so the AVX2 kernel, which
+folds eight at a time, is taken when the cpu has it, and a quarter of
+them hold NaNs.
+
+  cc -std=c11 -O2 parsing.c mpc.c -ledit -lm -o parsing
+  python3 tests/fold.py ./parsing [cases] [seed]
+"""
+import math
+import random
+import subprocess
+import sys
+
+
+def element(rng, nans):
+    if rng.random() < nans:
+        return "nan"
+    return "%.3f" % (rng.randint(-10 ** 6, 10 ** 6) / 1000)
+
+
+def fold(op, xs):
+    r = xs[0]
+    for x in xs[1:]:
+        if (x > r) if op == "max" else (x < r):
+            r = x
+    return r
+
+
+def same(a, b):
+    return a == b or (math.isnan(a) and math.isnan(b))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    binary = sys.argv[1]
+    n = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+    rng = random.Random(int(sys.argv[3]) if len(sys.argv) > 3 else 1)
+    cases = []
+    for _ in range(n):
+        nans = rng.choice([0, 0, 0, 0.1])
+        xs = [element(rng, nans) for _ in range(rng.randint(1, 40))]
+        if rng.random() < 0.1:
+            xs[0] = "nan"
+        cases.append((rng.choice(["min", "max"]), xs))
+    text = "".join("(%s {%s})\n" % (op, " ".join(xs)) for op, xs in cases)
+    p = subprocess.run([binary], input=text, capture_output=True, text=True,
+                       timeout=600)
+    outs = p.stdout.split("lispty> ")[1:]
+    bad = 0
+    for (op, xs), out in zip(cases, outs):
+        want = fold(op, [float(x) for x in xs])
+        try:
+            got = float(out.strip())
+        except ValueError:
+            got = None
+        if got is None or not same(got, want):
+            bad += 1
+            if bad <= 5:
+                print("(%s {%s}): %s, want %r" % (op, " ".join(xs),
+                                                  out.strip(), want))
+    if len(outs) < len(cases):
+        bad += len(cases) - len(outs)
+        print("%d results missing" % (len(cases) - len(outs)))
+    print("%d cases, %d failures" % (len(cases), bad))
+    sys.exit(1 if bad else 0)
+
+
+if __name__ == "__main__":
+    main()
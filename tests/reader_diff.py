@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+"""Differential test of the lispty readers.
+
+Feeds the same generated lines to the prompt of `lispty` (lval_scan) and
+`lispty --mpc` (the mpc reference reader) and checks that both print the
+same results and the same parse errors. Lines come from the grammar and
+half of them are mutated with stray brackets, signs, dots, exponents and
+letters, so rejected input is covered as well as accepted input. Numbers
+include inf and nan, which is how infinities and NaNs print.
+
+  cc -std=c11 -O2 parsing.c mpc.c -ledit -lm -o parsing
+  python3 tests/reader_diff.py ./parsing [cases] [seed]
+"""
+import random
+import subprocess
+import sys
+
+# stats builtins print allocation counts, which differ between readers,
+# and powers of generated numbers get huge
+NAMES = ["+", "-", "*", "/", "%", "min", "max", "list", "head", "tail",
+         "join", "eval", "sum", "matrix", "rows", "shape", "transpose",
+         "matmul"]
+SPACES = ["", " ", "  ", "\t", " \r ", "\f", "\v"]
+JUNK = list("(){}-+.eE0123456789 \tabcdfimnxlrs\\\"'#;")
+
+
+def number(rng):
+    if rng.random() < 0.05:
+        return rng.choice(["", "-"]) + rng.choice(["inf", "nan"])
+    s = rng.choice(["", "-"]) + str(rng.randint(0, 10 ** rng.choice([1, 3, 20, 40])))
+    r = rng.random()
+    if r < 0.2:
+        s += "." + str(rng.randint(0, 999))
+    if r < 0.1 or r > 0.9:
+        s += rng.choice("eE") + rng.choice(["", "+", "-"]) + str(rng.randint(0, 30))
+    return s
+
+
+def expr(rng, depth):
+    if depth > 6 or rng.random() < 0.5:
+        return number(rng) if rng.random() < 0.5 else rng.choice(NAMES)
+    o, c = rng.choice(["()", "{}"])
+    sep = rng.choice(SPACES)
+    items = [expr(rng, depth + 1) for _ in range(rng.randint(0, 5))]
+    return o + rng.choice(SPACES) + sep.join(items) + rng.choice(SPACES) + c
+
+
+def mutate(rng, s):
+    s = list(s)
+    for _ in range(rng.randint(1, 3)):
+        k = rng.randint(0, len(s))
+        op = rng.random()
+        if op < 0.4:
+            s.insert(k, rng.choice(JUNK))
+        elif s and op < 0.7:
+            del s[min(k, len(s) - 1)]
+        elif s:
+            s[min(k, len(s) - 1)] = rng.choice(JUNK)
+    return "".join(s)
+
+
+def line(rng):
+    n = rng.randint(0, 4) if rng.random() < 0.8 else rng.randint(5, 40)
+    s = " ".join(expr(rng, 0) for _ in range(n))
+    if rng.random() < 0.5:
+        s = mutate(rng, s)
+    return s.replace("\n", " ")
+
+
+def run(binary, args, text):
+    p = subprocess.run([binary] + args, input=text, capture_output=True,
+                       text=True, timeout=600)
+    return p.stdout.split("lispty> "), p.stderr
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    binary = sys.argv[1]
+    cases = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+    rng = random.Random(int(sys.argv[3]) if len(sys.argv) > 3 else 1)
+    lines = [line(rng) for _ in range(cases)]
+    text = "\n".join(lines) + "\n"
+    scan, scan_err = run(binary, [], text)
+    ref, ref_err = run(binary, ["--mpc"], text)
+
+    # a reader rejecting what the grammar accepts is reported on stderr
+    bad = 0
+    for err in (scan_err, ref_err):
+        if err:
+            bad += 1
+            print(err, end="")
+    for i, (a, b) in enumerate(zip(scan[1:], ref[1:])):
+        if a != b:
+            bad += 1
+            if bad <= 5:
+                print("input:     %r\nlval_scan: %r\nmpc:       %r" % (lines[i], a, b))
+    if len(scan) != len(ref):
+        bad += 1
+        print("outputs differ in length: %d vs %d" % (len(scan), len(ref)))
+    print("%d cases, %d mismatches" % (cases, bad))
+    sys.exit(1 if bad else 0)
+
+
+if __name__ == "__main__":
+    main()